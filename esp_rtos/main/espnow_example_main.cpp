@@ -1,13 +1,17 @@
+#include "driver/adc.h"
+#include "driver/pwm.h"
 #include "esp_event_loop.h"
 #include "esp_log.h"
 #include "esp_now.h"
 #include "esp_sleep.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "esp_wifi.h"
 #include "espnow_example.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "freertos/timers.h"
+#include "nvs.h"
 #include "nvs_flash.h"
 #include "rom/crc.h"
 #include "rom/ets_sys.h"
@@ -25,11 +29,97 @@ static uint8_t example_broadcast_mac[ESP_NOW_ETH_ALEN] = {0xFF, 0xFF, 0xFF,
 
 const int WIFI_CHANNEL = 4;
 
-const bool IS_COORDINATOR = false; // True for only one device
+const bool IS_COORDINATOR = false; // True for only one device per group
+
+// Every frame carries the group id, and frames from other groups are dropped
+// before anything else happens. Must match the Arduino build's GROUP_ID.
+const uint16_t GROUP_ID = 0xD00D;
+// Which door this button belongs to. A coordinator runs one dash per door.
+const uint8_t DOOR_ID = 0;
+// Coordinator only: number of doors it serves, with ids 0 to NUM_DOORS - 1
+const uint8_t NUM_DOORS = 1;
+
+// Every frame ends with a truncated SipHash-2-4 tag over the sender's MAC and
+// the frame, keyed with CONFIG_ESPNOW_LMK. ESP-NOW encryption can't be used
+// with the broadcast peer, so this is what stops forged or replayed frames.
+const uint8_t *FRAME_KEY = (const uint8_t *)CONFIG_ESPNOW_LMK;
+const uint8_t FRAME_TAG_LEN = 4;
+// Nodes the coordinator keeps telemetry for
+const uint8_t MAX_NODES = 16;
+// Number of senders whose last frame counter we remember: every node, and a
+// few more for neighbors and strangers
+const uint8_t REPLAY_TABLE_SIZE = MAX_NODES + 4;
+// The frame counter has to keep increasing across power loss, so blocks of it
+// are reserved in NVS
+const uint32_t FRAME_COUNTER_RESERVATION = 4096;
+// Reserved this many frames early, see the Arduino build
+const uint32_t FRAME_COUNTER_LOW_WATER = 256;
+
+// Reading the ADC with the radio on upsets WiFi, so the battery is only
+// sampled every BATTERY_SAMPLE_INTERVAL_WAKES wakes (about a minute)
+const uint32_t BATTERY_SAMPLE_INTERVAL_WAKES = 30;
+// Below this the ADC isn't wired up (or we're on USB), so assume mains power
+const uint32_t BATTERY_UNKNOWN__mv = 2500;
+const uint32_t BATTERY_SAVER__mv = 3550;
+const uint32_t BATTERY_CRITICAL__mv = 3400;
+// Avoid flapping between modes as the voltage recovers after a dash
+const uint32_t BATTERY_HYSTERESIS__mv = 50;
+// The coordinator flags nodes below this so they get charged before they drop
+// out
+const uint32_t BATTERY_CHARGE_WARNING__mv = 3500;
+const unsigned long CHARGE_REPORT_INTERVAL__ms = 60e3;
+
+// Telemetry rides along on every TELEMETRY_EVERY_N_FRAMES-th frame a button
+// sends during a dash, so it costs no extra wakes and little airtime
+const uint8_t TELEMETRY_EVERY_N_FRAMES = 10;
+// How often the coordinator streams updated telemetry over serial
+const unsigned long TELEMETRY_REPORT_INTERVAL__ms = 1e3;
+// Serial record framing, see tools/telemetry.py
+const uint8_t SERIAL_RECORD_SYNC[2] = {0xD0, 0xDA};
+const uint8_t SERIAL_RECORD_TELEMETRY = 1;
 const gpio_num_t D1 = GPIO_NUM_5;
 const gpio_num_t D2 = GPIO_NUM_4;
 const gpio_num_t BUTTON_LED = D2;
 const gpio_num_t BUTTON_INPUT = D1;
+// LED dimming, see LedPattern. The PWM driver counts duty in us of the
+// period, so LED_PWM_RANGE is the period.
+const uint32_t LED_PWM_RANGE = 1000; // 1 kHz
+// PWM duty for each brightness, (level / 255)^2.2 * LED_PWM_RANGE rounded
+const uint16_t LED_GAMMA[256] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1,
+    1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 5, 5,
+    6, 6, 7, 7, 8, 8, 9, 10, 10, 11, 12, 13,
+    13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24,
+    25, 27, 28, 29, 30, 32, 33, 34, 36, 37, 38, 40,
+    41, 43, 45, 46, 48, 49, 51, 53, 55, 56, 58, 60,
+    62, 64, 66, 68, 70, 72, 74, 76, 78, 80, 82, 85,
+    87, 89, 92, 94, 96, 99, 101, 104, 106, 109, 111, 114,
+    117, 119, 122, 125, 128, 130, 133, 136, 139, 142, 145, 148,
+    151, 154, 157, 160, 164, 167, 170, 173, 177, 180, 184, 187,
+    190, 194, 198, 201, 205, 208, 212, 216, 220, 223, 227, 231,
+    235, 239, 243, 247, 251, 255, 259, 263, 267, 272, 276, 280,
+    284, 289, 293, 298, 302, 307, 311, 316, 320, 325, 330, 334,
+    339, 344, 349, 354, 359, 364, 369, 374, 379, 384, 389, 394,
+    399, 405, 410, 415, 421, 426, 431, 437, 442, 448, 453, 459,
+    465, 470, 476, 482, 488, 494, 500, 505, 511, 517, 523, 530,
+    536, 542, 548, 554, 560, 567, 573, 580, 586, 592, 599, 605,
+    612, 619, 625, 632, 639, 646, 652, 659, 666, 673, 680, 687,
+    694, 701, 708, 715, 723, 730, 737, 745, 752, 759, 767, 774,
+    782, 789, 797, 805, 812, 820, 828, 836, 843, 851, 859, 867,
+    875, 883, 891, 899, 908, 916, 924, 932, 941, 949, 957, 966,
+    974, 983, 991, 1000,
+};
+const uint32_t LED_FULL_CURRENT__ua = 20000;
+// For power captures, see tools/power_correlate.py. Every power event pulses
+// MARKER_PIN, which goes to a digital input on the current analyzer, and is
+// logged as "EV <us> <name>" just before sleeping.
+const bool POWER_MARKERS = false;
+const gpio_num_t MARKER_PIN = GPIO_NUM_14; // D5
+const uint32_t MARKER_PULSE__us = 30;
+const uint8_t MAX_POWER_EVENTS = 32;
+// Battery+ goes to A0 through an extra 130k resistor, on top of the board's
+// 220k/100k divider. That puts 4.5V at the top of the ADC range.
+const uint32_t BATTERY_ADC_FULL_SCALE__mv = 4500;
 #define HIGH 1
 #define LOW 0
 
@@ -47,20 +137,175 @@ enum States_t {
   DOOR_DASH_COOL_DOWN_UNKNOWN = 7,
 } States;
 
-const unsigned long SLEEP_DURATION__us = 2e6;
-const unsigned long LISTEN_TIME__ms = 50;
-const unsigned long DOOR_DASH_REBROADCAST_INTERVAL__ms = 20;
-const unsigned long DOOR_DASH_WAITING_FLASH_FREQUENCY__ms = 500;
-const unsigned long DOOR_DASH_WINNER_FLASH_FREQUENCY__ms = 120;
-const unsigned long DOOR_DASH_COORDINATION_DURATION__ms = 17e3;
-const unsigned long FLASH_DURATION__ms = 5e3;
-const unsigned long COOL_DOWN__ms = 15e3;
+// Same numbering and names as the Arduino build
+enum PowerEvent_t {
+  EVENT_WAKE = 0,
+  EVENT_RADIO_ON = 1,
+  EVENT_LISTEN = 2,
+  EVENT_TX = 3, // Sending presses while waiting for a winner
+  EVENT_LED = 4,
+  EVENT_COOL_DOWN = 5,
+  EVENT_SHUTDOWN = 6, // Logging and stopping the radio
+  EVENT_SLEEP = 7,
+  EVENT_RADIO_OFF = 8,
+};
+const char *POWER_EVENT_NAMES[] = {"wake",     "radio_on", "listen",
+                                   "tx",       "led",      "cooldown",
+                                   "shutdown", "sleep",    "radio_off"};
+
+struct PowerEvent {
+  int64_t at__us;
+  PowerEvent_t event;
+};
+PowerEvent globalPowerEvents[MAX_POWER_EVENTS];
+uint8_t globalPowerEventCount = 0;
+
+enum TimingProfile_t {
+  PROFILE_BALANCED = 0,
+  PROFILE_LOW_LATENCY = 1,
+  PROFILE_MAX_BATTERY = 2,
+  PROFILE_CUSTOM = 3,
+};
+
+// Timing the coordinator can change over the air, see TimingConfig in
+// src/main.cpp. This build only receives it, and keeps it in NVS.
+struct __attribute__((packed)) TimingConfig {
+  uint16_t version; // 0 for the built in defaults, higher replaces lower
+  uint8_t profile;  // TimingProfile_t
+  uint32_t sleepDuration__us;
+  uint16_t listenTime__ms;
+  uint16_t rebroadcastInterval__ms;
+  uint16_t waitingFlashFrequency__ms;
+  uint16_t winnerFlashFrequency__ms;
+  uint16_t coordinationDuration__ms;
+  uint16_t flashDuration__ms;
+  uint16_t coolDown__ms;
+};
+const TimingConfig TIMING_PROFILES[] = {
+    // version, profile, sleep, listen, rebroadcast, waiting flash, winner
+    // flash, coordination, flash, cool down
+    {0, PROFILE_BALANCED, 2000000, 50, 20, 500, 120, 17000, 5000, 15000},
+    {0, PROFILE_LOW_LATENCY, 1000000, 50, 10, 500, 120, 17000, 5000, 15000},
+    {0, PROFILE_MAX_BATTERY, 4000000, 40, 15, 500, 120, 12000, 6000, 5000},
+};
+TimingConfig globalTiming = TIMING_PROFILES[PROFILE_BALANCED];
+TimingConfig globalPendingTiming = {}; // Applied at the next wake
+
+enum PowerMode_t {
+  POWER_NORMAL = 0,
+  POWER_SAVER = 1,
+  POWER_CRITICAL = 2,
+};
+
+// As the battery sags, sleep longer, stop relaying other nodes' frames and
+// keep the LED on for less time after a dash
+struct PowerPolicy {
+  uint8_t sleepMultiplier;
+  bool relay;
+  uint8_t coolDownDivisor;
+};
+const PowerPolicy POWER_POLICIES[] = {
+    {1, true, 1},  // POWER_NORMAL
+    {2, false, 2}, // POWER_SAVER
+    {4, false, 4}, // POWER_CRITICAL
+};
+
+// Same patterns as the Arduino build, see LedPattern there
+enum LedPatternId_t {
+  LED_WAITING = 0,
+  LED_WINNER = 1,
+  LED_LOSER = 2,
+  LED_UNKNOWN = 3,
+  NUM_LED_PATTERNS = 4,
+};
+
+enum LedShape_t {
+  LED_SOLID = 0,
+  LED_BLINK = 1,
+  LED_BREATHE = 2,
+};
+
+struct LedPattern {
+  const char *name;
+  LedShape_t shape;
+  uint8_t high;
+  uint8_t low;
+  uint32_t budget__ua; // 0 for no budget
+};
+const LedPattern LED_PATTERNS[NUM_LED_PATTERNS] = {
+    {"waiting", LED_BREATHE, 255, 16, 4000},
+    {"winner", LED_BLINK, 255, 0, 8000},
+    {"loser", LED_SOLID, 80, 80, 2000},
+    {"unknown", LED_BLINK, 96, 0, 1000},
+};
+
+struct LedUsage {
+  int64_t shown__us;
+  uint64_t charge__pc; // uA * us
+};
+float globalLedScale[NUM_LED_PATTERNS] = {}; // 0 until first shown
+LedUsage globalLedUsage[NUM_LED_PATTERNS] = {};
+LedPatternId_t globalLedPattern = LED_WAITING;
+bool globalLedShowing = false;
+uint32_t globalLedDuty = 0;
+int64_t globalLedUpdatedAt__us = 0;
 
 States_t globalState = SLEEP_LISTEN;
 unsigned long globalDoorDashStartedAt = 0;
-bool globalHasDeclaredWinner = false;
+
+// Coordinator state for one door. Each door runs its own independent dash.
+struct DashContext {
+  bool hasDeclaredWinner;
+  bool announced; // The winner was printed, by the loop
+  unsigned long startedAt;
+  uint8_t winnerMac[6];
+};
+DashContext globalDashes[NUM_DOORS] = {};
+
+struct ReplayEntry {
+  uint8_t mac[6];
+  uint32_t counter;
+  int64_t heardAt__us;
+};
+// Light sleep keeps RAM, so unlike the Arduino build none of this needs to be
+// saved before sleeping
+ReplayEntry globalReplay[REPLAY_TABLE_SIZE] = {};
+uint32_t globalFrameCounter = 0;
+uint32_t globalFrameCounterCeiling = 0;
+
+uint32_t globalWakeCount = 0;
+uint32_t globalBattery__mv = 0; // Filtered, 0 if unknown
+PowerMode_t globalPowerMode = POWER_NORMAL;
+
+// Telemetry counters, see TelemetryStruct
+uint32_t globalDashCount = 0;
+uint32_t globalTxFrames = 0;
+uint32_t globalRxFrames = 0;
+uint32_t globalMissedWinners = 0;
+uint32_t globalLastLatency__ms = 0;
+
+uint8_t selfMac[6] = {};
+// Time spent verifying frames since the last wake, to check that
+// authentication doesn't eat into listenTime__ms
+int64_t globalVerifyTime__us = 0;
+uint32_t globalVerifiedFrames = 0;
+
+const uint8_t FRAME_HAS_TELEMETRY = 1 << 0;
+// Firmware updates aren't supported by this build, these frames are dropped
+const uint8_t FRAME_FIRMWARE = 1 << 1;
+// Sender's node class, see NODE_CLASS in src/main.cpp. This build is always a
+// battery relay (0).
+const uint8_t FRAME_NODE_CLASS_MASK = 3 << 2;
+const uint8_t FRAME_TIMING = 1 << 4; // Followed by a TimingConfig
 
 struct __attribute__((packed)) DataStruct {
+  uint16_t group_id;
+  uint8_t door_id;
+  uint32_t counter; // Strictly increasing per sender, to reject replays
+  uint8_t battery;  // Sender's battery, see encodeBattery()
+  uint8_t flags; // FRAME_HAS_TELEMETRY, FRAME_FIRMWARE, FRAME_NODE_CLASS_MASK,
+                 // FRAME_TIMING
+
   // Device sending to master that the device's button was pressed
   uint8_t button_pressed_mac[6]; // PRESSED_MSG
 
@@ -68,6 +313,39 @@ struct __attribute__((packed)) DataStruct {
   uint8_t winner_mac[6]; // WINNER_MSG
 };
 
+// Counters a button reports about itself. Counters wrap rather than saturate.
+// Relays forward other buttons' telemetry too, so node_mac isn't necessarily
+// the sender.
+struct __attribute__((packed)) TelemetryStruct {
+  uint8_t node_mac[6];
+  uint16_t wakes;
+  uint16_t dashes;
+  uint16_t tx_frames;
+  uint16_t rx_frames;
+  uint8_t missed_winners;    // Dashes that ended without hearing a winner
+  uint16_t last_latency__ms; // From the start of the dash to hearing a winner
+  uint8_t battery;
+  uint16_t timing_version; // TimingConfig in use
+};
+
+const int MAX_FRAME_LEN =
+    sizeof(DataStruct) +
+    (sizeof(TelemetryStruct) > sizeof(TimingConfig) ? sizeof(TelemetryStruct)
+                                                    : sizeof(TimingConfig)) +
+    FRAME_TAG_LEN;
+
+// Most recent telemetry from another button, waiting to be forwarded
+TelemetryStruct globalRelayedTelemetry = {};
+bool globalHasRelayedTelemetry = false;
+uint8_t globalFramesUntilTelemetry = 0;
+
+// Coordinator only: latest telemetry from each node
+struct NodeTelemetry {
+  TelemetryStruct telemetry;
+  bool updated; // Since it was last streamed over serial
+};
+NodeTelemetry globalNodes[MAX_NODES] = {};
+
 void buttonCallBackFunction(const uint8_t *senderMac,
                             const uint8_t *incomingData, int len);
 void coordinatorCallBackFunction(const uint8_t *senderMac,
@@ -105,6 +383,8 @@ static esp_err_t example_espnow_init(void) {
   /* Initialize ESPNOW and register sending and receiving callback function.
    */
   ESP_ERROR_CHECK(esp_now_init());
+  // Before the callbacks, which compare against it
+  esp_wifi_get_mac(ESPNOW_WIFI_IF, selfMac);
   if (IS_COORDINATOR) {
     Serial::println("Setup finished for coordinator");
     ESP_ERROR_CHECK(esp_now_register_recv_cb(coordinatorCallBackFunction));
@@ -113,8 +393,8 @@ static esp_err_t example_espnow_init(void) {
     ESP_ERROR_CHECK(esp_now_register_recv_cb(buttonCallBackFunction));
   }
 
-  /* Set primary master key. */
-  //   ESP_ERROR_CHECK(esp_now_set_pmk((uint8_t *)CONFIG_ESPNOW_PMK));
+  /* ESP-NOW encryption doesn't work with the broadcast peer. Frames are
+   * authenticated with a SipHash tag instead, see sendFrame(). */
 
   /* Add broadcast peer information to peer list. */
   esp_now_peer_info_t *peer =
@@ -135,28 +415,162 @@ static esp_err_t example_espnow_init(void) {
   return ESP_OK;
 }
 
+// BUTTON_LED belongs to the PWM driver, see setupLed()
 void setup_gpio() {
-  gpio_config_t io_conf = {
-      .pin_bit_mask = (1ULL << BUTTON_LED),
-      .mode = GPIO_MODE_OUTPUT,
-      .pull_up_en = GPIO_PULLUP_DISABLE,
-      .pull_down_en = GPIO_PULLDOWN_DISABLE,
-      .intr_type = GPIO_INTR_DISABLE,
-  };
-  gpio_config(&io_conf);
-
   gpio_config_t config = {.pin_bit_mask = (1ULL << BUTTON_INPUT),
                           .mode = GPIO_MODE_INPUT,
                           .pull_up_en = GPIO_PULLUP_ENABLE,
                           .pull_down_en = GPIO_PULLDOWN_DISABLE,
                           .intr_type = GPIO_INTR_DISABLE};
   gpio_config(&config);
+
+  if (POWER_MARKERS) {
+    gpio_config_t marker = {.pin_bit_mask = (1ULL << MARKER_PIN),
+                            .mode = GPIO_MODE_OUTPUT,
+                            .pull_up_en = GPIO_PULLUP_DISABLE,
+                            .pull_down_en = GPIO_PULLDOWN_DISABLE,
+                            .intr_type = GPIO_INTR_DISABLE};
+    gpio_config(&marker);
+  }
+}
+
+// Once the log is full, events are neither logged nor pulsed, so that pulses
+// and log lines still pair up
+void markPowerEvent(PowerEvent_t event) {
+  if (!POWER_MARKERS || globalPowerEventCount == MAX_POWER_EVENTS) {
+    return;
+  }
+  gpio_set_level(MARKER_PIN, 1);
+  globalPowerEvents[globalPowerEventCount].at__us = esp_timer_get_time();
+  globalPowerEvents[globalPowerEventCount].event = event;
+  globalPowerEventCount++;
+  ets_delay_us(MARKER_PULSE__us);
+  gpio_set_level(MARKER_PIN, 0);
+}
+
+void printPowerEvents() {
+  if (!POWER_MARKERS) {
+    return;
+  }
+  for (int i = 0; i < globalPowerEventCount; i++) {
+    printf("EV %u %s\n", (uint32_t)globalPowerEvents[i].at__us,
+           POWER_EVENT_NAMES[globalPowerEvents[i].event]);
+  }
+  globalPowerEventCount = 0;
+  fflush(stdout);
+}
+
+// Brightness of a pattern at a phase of 0-255 through its period
+uint8_t ledLevel(const LedPattern *pattern, uint8_t phase) {
+  switch (pattern->shape) {
+  case LED_BLINK:
+    return phase < 128 ? pattern->low : pattern->high;
+  case LED_BREATHE: {
+    uint8_t ramp = phase < 128 ? phase * 2 : 255 - (phase - 128) * 2;
+    return pattern->low + (pattern->high - pattern->low) * ramp / 255;
+  }
+  default:
+    return pattern->high;
+  }
+}
+
+uint32_t ledCurrent__ua(uint32_t duty) {
+  return (uint64_t)duty * LED_FULL_CURRENT__ua / LED_PWM_RANGE;
+}
+
+// Worked out the first time a pattern is shown. Duties are rounded down after
+// scaling, so the pattern averages at most its budget.
+float ledScale(LedPatternId_t id) {
+  if (globalLedScale[id] == 0) {
+    const LedPattern *pattern = &LED_PATTERNS[id];
+    uint32_t total = 0;
+    for (int phase = 0; phase < 256; phase++) {
+      total += LED_GAMMA[ledLevel(pattern, phase)];
+    }
+    float average__ua =
+        (float)total / 256 * LED_FULL_CURRENT__ua / LED_PWM_RANGE;
+    globalLedScale[id] = 1;
+    if (pattern->budget__ua > 0 && average__ua > pattern->budget__ua) {
+      globalLedScale[id] = pattern->budget__ua / average__ua;
+    }
+  }
+  return globalLedScale[id];
+}
+
+void setupLed() {
+  uint32_t duty = 0;
+  uint32_t pin = BUTTON_LED;
+  ESP_ERROR_CHECK(pwm_init(LED_PWM_RANGE, &duty, 1, &pin));
+  ESP_ERROR_CHECK(pwm_set_channel_invert(0x1)); // The LED is active low
+  ESP_ERROR_CHECK(pwm_set_phase(0, 0));
+}
+
+// Charges the time since the last update to the pattern that was showing
+void updateLedUsage() {
+  int64_t now__us = esp_timer_get_time();
+  if (globalLedShowing) {
+    int64_t elapsed__us = now__us - globalLedUpdatedAt__us;
+    LedUsage *usage = &globalLedUsage[globalLedPattern];
+    usage->shown__us += elapsed__us;
+    usage->charge__pc += (uint64_t)ledCurrent__ua(globalLedDuty) * elapsed__us;
+  }
+  globalLedUpdatedAt__us = now__us;
+}
+
+void setLedDuty(uint32_t duty) {
+  if (duty != globalLedDuty) {
+    pwm_set_duty(0, duty);
+    pwm_start();
+    globalLedDuty = duty;
+  }
+}
+
+// Before light sleep, since the PWM timer would keep waking us
+void ledOff() {
+  updateLedUsage();
+  globalLedShowing = false;
+  pwm_stop(0x1); // Leaves the pin high, LED off
+  globalLedDuty = 0;
+}
+
+void printLedReport() {
+  for (int i = 0; i < NUM_LED_PATTERNS; i++) {
+    LedUsage *usage = &globalLedUsage[i];
+    if (usage->shown__us < 1000) {
+      continue;
+    }
+    ESP_LOGI(TAG, "LED %s: %d ms, %u uC, average %u uA (budget %u uA)",
+             LED_PATTERNS[i].name, (int)(usage->shown__us / 1000),
+             (uint32_t)(usage->charge__pc / 1000000),
+             (uint32_t)(usage->charge__pc / usage->shown__us),
+             LED_PATTERNS[i].budget__ua);
+  }
+  memset(globalLedUsage, 0, sizeof(globalLedUsage));
 }
 
-void setLed(bool on) { gpio_set_level(BUTTON_LED, !on); }
 bool isButtonPressed() { return !gpio_get_level(BUTTON_INPUT); }
+void markStatePowerEvent() {
+  switch (globalState) {
+  case DOOR_DASH_WAITING:
+    markPowerEvent(EVENT_TX);
+    break;
+  case DOOR_DASH_WINNER:
+  case DOOR_DASH_LOSER:
+    markPowerEvent(EVENT_LED);
+    break;
+  case DOOR_DASH_COOL_DOWN_WINNER:
+  case DOOR_DASH_COOL_DOWN_LOSER:
+  case DOOR_DASH_COOL_DOWN_UNKNOWN:
+    markPowerEvent(EVENT_COOL_DOWN);
+    break;
+  default:
+    break;
+  }
+}
+
 void transitionState(States_t newState) {
   globalState = newState;
+  markStatePowerEvent();
 
   switch (newState) {
   case SLEEP_LISTEN:
@@ -186,20 +600,116 @@ void transitionState(States_t newState) {
   }
 }
 
+const PowerPolicy *currentPowerPolicy() {
+  return &POWER_POLICIES[globalPowerMode];
+}
+
+// Capped at the flash duration, or a node sleeping longer in a power saving
+// mode could sleep through a whole dash
+unsigned long sleepDuration__us() {
+  unsigned long sleep__us =
+      globalTiming.sleepDuration__us * currentPowerPolicy()->sleepMultiplier;
+  unsigned long flash__us = globalTiming.flashDuration__ms * 1000UL;
+  return sleep__us < flash__us ? sleep__us : flash__us;
+}
+
+unsigned long coolDown__ms() {
+  return globalTiming.coolDown__ms / currentPowerPolicy()->coolDownDivisor;
+}
+
+void updatePowerMode() {
+  uint32_t mv = globalBattery__mv;
+  // Only step down below a threshold, only step back up once clear of it
+  uint32_t margin = BATTERY_HYSTERESIS__mv;
+  if (mv == 0) {
+    globalPowerMode = POWER_NORMAL;
+  } else if (mv < BATTERY_CRITICAL__mv) {
+    globalPowerMode = POWER_CRITICAL;
+  } else if (mv < BATTERY_SAVER__mv) {
+    if (globalPowerMode != POWER_CRITICAL ||
+        mv > BATTERY_CRITICAL__mv + margin) {
+      globalPowerMode = POWER_SAVER;
+    }
+  } else if (globalPowerMode == POWER_NORMAL ||
+             mv > BATTERY_SAVER__mv + margin) {
+    globalPowerMode = POWER_NORMAL;
+  } else if (globalPowerMode == POWER_CRITICAL) {
+    globalPowerMode = POWER_SAVER;
+  }
+}
+
+void sampleBattery() {
+  uint16_t raw = 0;
+  if (adc_read(&raw) != ESP_OK) {
+    return;
+  }
+  uint32_t mv = raw * BATTERY_ADC_FULL_SCALE__mv / 1023;
+  if (mv < BATTERY_UNKNOWN__mv) {
+    globalBattery__mv = 0;
+  } else if (globalBattery__mv == 0) {
+    globalBattery__mv = mv;
+  } else { // Smooth out ADC noise and the sag while the radio is on
+    globalBattery__mv = (globalBattery__mv * 3 + mv) / 4;
+  }
+  updatePowerMode();
+}
+
+// Battery voltage in 10mV steps above 2V, so it fits in a byte. 0 if unknown.
+uint8_t encodeBattery(uint32_t mv) {
+  if (mv < 2000) {
+    return 0;
+  }
+  uint32_t steps = (mv - 2000) / 10;
+  return steps > 255 ? 255 : steps;
+}
+
+uint32_t decodeBattery(uint8_t battery) {
+  return battery == 0 ? 0 : 2000 + battery * 10;
+}
+
+void printVerifyStats() {
+  ESP_LOGI(TAG, "Verified %u frames in %d us", globalVerifiedFrames,
+           (int)globalVerifyTime__us);
+}
+
 void goToSleep() {
+  markPowerEvent(EVENT_SHUTDOWN);
+  printVerifyStats();
+  globalVerifyTime__us = 0;
+  globalVerifiedFrames = 0;
+  ledOff();
+  printLedReport();
   Serial::println("Going to sleep");
   transitionState(SLEEP_LISTEN);
   globalDoorDashStartedAt = 0;
-  globalHasDeclaredWinner = false;
-  setLed(false);
   esp_now_deinit();
   esp_wifi_stop();
+  markPowerEvent(EVENT_RADIO_OFF);
   gpio_wakeup_enable(BUTTON_INPUT, GPIO_INTR_LOW_LEVEL);
   esp_sleep_enable_gpio_wakeup();
-  esp_sleep_enable_timer_wakeup(2e6);
+  esp_sleep_enable_timer_wakeup(sleepDuration__us());
+  // Printing these lines shows up as the first few ms of sleep
+  markPowerEvent(EVENT_SLEEP);
+  printPowerEvents();
   esp_light_sleep_start();
 }
 
+// Cheap filter that runs before any other work in the receive callbacks
+bool isOwnGroup(const uint8_t *incomingData, int len) {
+  return len >= sizeof(DataStruct) + FRAME_TAG_LEN && len <= MAX_FRAME_LEN &&
+         ((DataStruct *)incomingData)->group_id == GROUP_ID &&
+         !(((DataStruct *)incomingData)->flags & FRAME_FIRMWARE);
+}
+
+bool isMacEmpty(const uint8_t *mac) {
+  for (int i = 0; i < 6; i++) {
+    if (mac[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool isWinnerMsg(DataStruct *data) {
   for (int i = 0; i < 6; i++) {
     if (data->winner_mac[i] != 0) {
@@ -216,65 +726,438 @@ void getMacAddress(uint8_t *mac) {
   esp_wifi_get_mac(ESPNOW_WIFI_IF, mac);
 }
 
+#define SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND                                                              \
+  do {                                                                         \
+    v0 += v1;                                                                  \
+    v1 = SIP_ROTL(v1, 13);                                                     \
+    v1 ^= v0;                                                                  \
+    v0 = SIP_ROTL(v0, 32);                                                     \
+    v2 += v3;                                                                  \
+    v3 = SIP_ROTL(v3, 16);                                                     \
+    v3 ^= v2;                                                                  \
+    v0 += v3;                                                                  \
+    v3 = SIP_ROTL(v3, 21);                                                     \
+    v3 ^= v0;                                                                  \
+    v2 += v1;                                                                  \
+    v1 = SIP_ROTL(v1, 17);                                                     \
+    v1 ^= v2;                                                                  \
+    v2 = SIP_ROTL(v2, 32);                                                     \
+  } while (0)
+
+uint64_t readLe64(const uint8_t *p, int len) {
+  uint64_t value = 0;
+  for (int i = len - 1; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+// SipHash-2-4, see https://www.aumasson.jp/siphash/siphash.pdf
+uint64_t sipHash24(const uint8_t *key, const uint8_t *in, int len) {
+  uint64_t k0 = readLe64(key, 8);
+  uint64_t k1 = readLe64(key + 8, 8);
+  uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+  uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+  uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+  uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+  int end = len - (len % 8);
+  for (int i = 0; i < end; i += 8) {
+    uint64_t m = readLe64(in + i, 8);
+    v3 ^= m;
+    SIP_ROUND;
+    SIP_ROUND;
+    v0 ^= m;
+  }
+  uint64_t last = ((uint64_t)len << 56) | readLe64(in + end, len - end);
+  v3 ^= last;
+  SIP_ROUND;
+  SIP_ROUND;
+  v0 ^= last;
+
+  v2 ^= 0xff;
+  SIP_ROUND;
+  SIP_ROUND;
+  SIP_ROUND;
+  SIP_ROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// The tag covers the sender's MAC so that a captured frame can't be replayed
+// under a different sender address with a fresh replay table entry
+void computeTag(const uint8_t *mac, const uint8_t *frame, int len,
+                uint8_t *tag) {
+  uint8_t message[6 + MAX_FRAME_LEN];
+  memcpy(message, mac, 6);
+  memcpy(message + 6, frame, len);
+  uint64_t hash = sipHash24(FRAME_KEY, message, 6 + len);
+  for (int i = 0; i < FRAME_TAG_LEN; i++) {
+    tag[i] = hash >> (8 * i);
+  }
+}
+
+/* Frame counters are reserved in blocks so that NVS is only written once
+ * every FRAME_COUNTER_RESERVATION frames, and after a cold boot. */
+void reserveFrameCounters() {
+  nvs_handle handle;
+  ESP_ERROR_CHECK(nvs_open("doordash", NVS_READWRITE, &handle));
+  uint32_t reserved = 0;
+  nvs_get_u32(handle, "frame_ctr", &reserved); // Stays 0 if never written
+  // Only after a boot, a top up from the loop keeps its counter
+  if (globalFrameCounterCeiling != reserved && globalFrameCounter < reserved) {
+    globalFrameCounter = reserved;
+  }
+  globalFrameCounterCeiling = globalFrameCounter + FRAME_COUNTER_RESERVATION;
+  ESP_ERROR_CHECK(nvs_set_u32(handle, "frame_ctr", globalFrameCounterCeiling));
+  ESP_ERROR_CHECK(nvs_commit(handle));
+  nvs_close(handle);
+}
+
+// Same limits as isTimingValid() in src/main.cpp
+bool isTimingValid(const TimingConfig *config) {
+  // Leaves listen for half of listenTime__ms and must still hear a rebroadcast
+  return config->profile <= PROFILE_CUSTOM &&
+         config->sleepDuration__us >= 100e3 &&
+         config->sleepDuration__us <= 60e6 &&
+         config->rebroadcastInterval__ms >= 5 &&
+         config->listenTime__ms / 2 > config->rebroadcastInterval__ms &&
+         config->flashDuration__ms * 1000UL >= config->sleepDuration__us &&
+         config->waitingFlashFrequency__ms > 0 &&
+         config->winnerFlashFrequency__ms > 0 &&
+         config->coordinationDuration__ms > config->flashDuration__ms;
+}
+
+void loadTimingConfig() {
+  nvs_handle handle;
+  ESP_ERROR_CHECK(nvs_open("doordash", NVS_READWRITE, &handle));
+  TimingConfig config;
+  size_t len = sizeof(config);
+  if (nvs_get_blob(handle, "timing", &config, &len) == ESP_OK &&
+      len == sizeof(config) && isTimingValid(&config)) {
+    globalTiming = config;
+  }
+  nvs_close(handle);
+}
+
+void applyTimingConfig(const TimingConfig *config) {
+  globalTiming = *config;
+  nvs_handle handle;
+  ESP_ERROR_CHECK(nvs_open("doordash", NVS_READWRITE, &handle));
+  ESP_ERROR_CHECK(nvs_set_blob(handle, "timing", config, sizeof(*config)));
+  ESP_ERROR_CHECK(nvs_commit(handle));
+  nvs_close(handle);
+  ESP_LOGI(TAG, "Using timing config %d", config->version);
+}
+
+// Called from the main loops, so sendFrame doesn't write NVS from a callback
+void topUpFrameCounters() {
+  if (globalFrameCounter + FRAME_COUNTER_LOW_WATER >=
+      globalFrameCounterCeiling) {
+    reserveFrameCounters();
+  }
+}
+
+uint32_t nextFrameCounter() {
+  if (globalFrameCounter >= globalFrameCounterCeiling) {
+    reserveFrameCounters(); // Only if the loop hasn't run, such as in a burst
+  }
+  return globalFrameCounter++;
+}
+
+// A new sender takes the slot of the one heard least recently, but never one
+// heard within the last dash, see the Arduino build
+bool isReplay(const uint8_t *senderMac, uint32_t counter) {
+  int64_t now__us = esp_timer_get_time();
+  ReplayEntry *oldest = NULL;
+  int64_t oldestAge__us = 0;
+  for (int i = 0; i < REPLAY_TABLE_SIZE; i++) {
+    ReplayEntry *entry = &globalReplay[i];
+    if (memcmp(entry->mac, senderMac, 6) == 0) {
+      if (counter <= entry->counter) {
+        return true;
+      }
+      entry->counter = counter;
+      entry->heardAt__us = now__us;
+      return false;
+    }
+    int64_t age__us =
+        isMacEmpty(entry->mac) ? INT64_MAX : now__us - entry->heardAt__us;
+    if (oldest == NULL || age__us > oldestAge__us) {
+      oldest = entry;
+      oldestAge__us = age__us;
+    }
+  }
+  if (oldestAge__us < globalTiming.coordinationDuration__ms * 1000LL) {
+    return true;
+  }
+  memcpy(oldest->mac, senderMac, 6);
+  oldest->counter = counter;
+  oldest->heardAt__us = now__us;
+  return false;
+}
+
+bool verifyFrame(const uint8_t *senderMac, const uint8_t *incomingData,
+                 int len) {
+  int64_t start = esp_timer_get_time();
+  uint8_t tag[FRAME_TAG_LEN];
+  int tagOffset = len - FRAME_TAG_LEN;
+  computeTag(senderMac, incomingData, tagOffset, tag);
+  uint8_t diff = 0;
+  for (int i = 0; i < FRAME_TAG_LEN; i++) {
+    diff |= tag[i] ^ incomingData[tagOffset + i];
+  }
+  bool valid =
+      diff == 0 && !isReplay(senderMac, ((DataStruct *)incomingData)->counter);
+  globalVerifyTime__us += esp_timer_get_time() - start;
+  globalVerifiedFrames++;
+  if (valid) {
+    globalRxFrames++;
+  }
+  return valid;
+}
+
+TelemetryStruct *getTelemetry(DataStruct *data, int len) {
+  if ((data->flags & FRAME_HAS_TELEMETRY) &&
+      len == sizeof(DataStruct) + sizeof(TelemetryStruct) + FRAME_TAG_LEN) {
+    return (TelemetryStruct *)((uint8_t *)data + sizeof(DataStruct));
+  }
+  return NULL;
+}
+
+TimingConfig *getTimingConfig(DataStruct *data, int len) {
+  if ((data->flags & FRAME_TIMING) &&
+      len == sizeof(DataStruct) + sizeof(TimingConfig) + FRAME_TAG_LEN) {
+    return (TimingConfig *)((uint8_t *)data + sizeof(DataStruct));
+  }
+  return NULL;
+}
+
+void fillOwnTelemetry(TelemetryStruct *telemetry) {
+  memcpy(telemetry->node_mac, selfMac, 6);
+  telemetry->wakes = globalWakeCount;
+  telemetry->dashes = globalDashCount;
+  telemetry->tx_frames = globalTxFrames;
+  telemetry->rx_frames = globalRxFrames;
+  telemetry->missed_winners = globalMissedWinners;
+  telemetry->last_latency__ms = globalLastLatency__ms;
+  telemetry->battery = encodeBattery(globalBattery__mv);
+  telemetry->timing_version = globalTiming.version;
+}
+
+// Alternates between our own telemetry and forwarding the last one we heard,
+// so buttons out of the coordinator's range still get reported
+bool nextTelemetry(TelemetryStruct *telemetry) {
+  if (IS_COORDINATOR || globalFramesUntilTelemetry-- > 0) {
+    return false;
+  }
+  globalFramesUntilTelemetry = TELEMETRY_EVERY_N_FRAMES - 1;
+  static bool forwardNext = false;
+  if (forwardNext && globalHasRelayedTelemetry &&
+      currentPowerPolicy()->relay) {
+    *telemetry = globalRelayedTelemetry;
+    globalHasRelayedTelemetry = false;
+  } else {
+    fillOwnTelemetry(telemetry);
+  }
+  forwardNext = !forwardNext;
+  return true;
+}
+
+void sendFrame(DataStruct *data) {
+  uint8_t frame[MAX_FRAME_LEN];
+  int len = sizeof(DataStruct);
+  data->counter = nextFrameCounter();
+  data->battery = encodeBattery(globalBattery__mv);
+  TelemetryStruct telemetry;
+  if (nextTelemetry(&telemetry)) {
+    data->flags |= FRAME_HAS_TELEMETRY;
+    memcpy(frame + len, &telemetry, sizeof(telemetry));
+    len += sizeof(telemetry);
+  }
+  memcpy(frame, data, sizeof(DataStruct));
+  computeTag(selfMac, frame, len, frame + len);
+  esp_now_send(BROADCAST_MAC, frame, len + FRAME_TAG_LEN);
+  globalTxFrames++;
+}
+
 void sendButtonPressed(uint8_t *mac) {
   DataStruct sendingData = {};
+  sendingData.group_id = GROUP_ID;
+  sendingData.door_id = DOOR_ID;
   memcpy((uint8_t *)sendingData.button_pressed_mac, mac, 6);
-  esp_now_send(BROADCAST_MAC, (uint8_t *)&sendingData,
-               sizeof(sendingData)); // NULL means send to all peers
+  sendFrame(&sendingData);
 }
 
-void sendWinner(uint8_t *winner) {
+void sendWinner(uint8_t doorId, uint8_t *winner) {
   DataStruct sendingData = {};
+  sendingData.group_id = GROUP_ID;
+  sendingData.door_id = doorId;
   // TODO make it cleaner instead of this 6. Make it a struct instead?
   memcpy((uint8_t *)sendingData.winner_mac, winner, 6);
-  esp_now_send(BROADCAST_MAC, (uint8_t *)&sendingData,
-               sizeof(sendingData)); // NULL means send to all peers
+  sendFrame(&sendingData);
 }
 
 void rebroadcast(uint8_t *data, uint8_t len) {
   esp_now_send(BROADCAST_MAC, data, len);
 }
 
-bool isMacAddressSelf(uint8_t *mac) {
-  uint8_t selfMacAddress[6] = {};
-  getMacAddress((uint8_t *)selfMacAddress);
-  for (int i = 0; i < 6; i++) {
-    if (mac[i] != selfMacAddress[i]) {
-      return false;
+bool isMacAddressSelf(uint8_t *mac) { return memcmp(mac, selfMac, 6) == 0; }
+
+uint32_t millis() { return (xTaskGetTickCount() * 1000) / configTICK_RATE_HZ; }
+
+void delay(int millis) { vTaskDelay(millis / portTICK_PERIOD_MS); }
+
+// Returns NULL once the table is full. Nodes are never evicted, MAX_NODES is
+// sized for a whole house.
+NodeTelemetry *findNode(const uint8_t *mac) {
+  for (int i = 0; i < MAX_NODES; i++) {
+    NodeTelemetry *node = &globalNodes[i];
+    if (memcmp(node->telemetry.node_mac, mac, 6) == 0) {
+      return node;
+    }
+    if (isMacEmpty(node->telemetry.node_mac)) {
+      memcpy(node->telemetry.node_mac, mac, 6);
+      return node;
     }
   }
-  return true;
+  return NULL;
 }
 
-uint32_t millis() { return (xTaskGetTickCount() * 1000) / configTICK_RATE_HZ; }
+void recordBattery(const uint8_t *mac, uint8_t battery) {
+  NodeTelemetry *node = findNode(mac);
+  if (node != NULL && node->telemetry.battery != battery) {
+    node->telemetry.battery = battery;
+    node->updated = true;
+  }
+}
 
-void delay(int millis) { vTaskDelay(millis / portTICK_PERIOD_MS); }
+void recordTelemetry(TelemetryStruct *telemetry) {
+  NodeTelemetry *node = findNode(telemetry->node_mac);
+  if (node != NULL) {
+    node->telemetry = *telemetry;
+    node->updated = true;
+  }
+}
+
+void printNodesNeedingCharge() {
+  for (int i = 0; i < MAX_NODES; i++) {
+    NodeTelemetry *node = &globalNodes[i];
+    uint32_t mv = decodeBattery(node->telemetry.battery);
+    if (mv != 0 && mv < BATTERY_CHARGE_WARNING__mv) {
+      ESP_LOGW(TAG, "Needs charging: " MACSTR " at %u mV",
+               MAC2STR(node->telemetry.node_mac), mv);
+    }
+  }
+}
+
+// CRC-16/CCITT-FALSE
+uint16_t crc16(const uint8_t *data, int len, uint16_t crc = 0xFFFF) {
+  for (int i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/* Binary records share the console UART with the logs. Each one is sync
+ * (2 bytes), type, payload length, payload, then a little endian CRC-16 over
+ * type, length and payload. */
+void writeSerialRecord(uint8_t type, const uint8_t *payload, uint8_t len) {
+  uint8_t header[2] = {type, len};
+  uint16_t crc = crc16(payload, len, crc16(header, sizeof(header)));
+  uint8_t trailer[2] = {(uint8_t)(crc & 0xFF), (uint8_t)(crc >> 8)};
+  fwrite(SERIAL_RECORD_SYNC, 1, sizeof(SERIAL_RECORD_SYNC), stdout);
+  fwrite(header, 1, sizeof(header), stdout);
+  fwrite(payload, 1, len, stdout);
+  fwrite(trailer, 1, sizeof(trailer), stdout);
+  fflush(stdout);
+}
+
+void streamTelemetry() {
+  for (int i = 0; i < MAX_NODES; i++) {
+    NodeTelemetry *node = &globalNodes[i];
+    if (!node->updated) {
+      continue;
+    }
+    node->updated = false;
+    uint8_t payload[4 + sizeof(TelemetryStruct)];
+    uint32_t now = millis();
+    memcpy(payload, &now, 4);
+    memcpy(payload + 4, &node->telemetry, sizeof(TelemetryStruct));
+    writeSerialRecord(SERIAL_RECORD_TELEMETRY, payload, sizeof(payload));
+  }
+}
 
 void coordinatorCallBackFunction(const uint8_t *senderMac,
                                  const uint8_t *incomingData, int len) {
+  if (!isOwnGroup(incomingData, len)) {
+    return;
+  }
   DataStruct *data = (DataStruct *)incomingData;
-  if (!globalHasDeclaredWinner) {
-    Serial::println("Declare winner: ");
-    printMac(data->button_pressed_mac);
-    ESP_LOGI(TAG, "\n"); // newline..
-    memcpy((uint8_t *)WINNER_MAC, data->button_pressed_mac, 6);
+  if (data->door_id >= NUM_DOORS ||
+      !verifyFrame(senderMac, incomingData, len)) {
+    return;
+  }
+  recordBattery(senderMac, data->battery);
+  TelemetryStruct *telemetry = getTelemetry(data, len);
+  if (telemetry != NULL) {
+    recordTelemetry(telemetry);
+  }
+  if (data->flags & FRAME_TIMING) { // From another coordinator or a relay
+    return;
+  }
+  // Buttons repeat our winner frames, they aren't presses
+  if (isWinnerMsg(data) || isMacEmpty(data->button_pressed_mac)) {
+    return;
+  }
+  DashContext *dash = &globalDashes[data->door_id];
+  if (!dash->hasDeclaredWinner) { // The loop prints it
+    memcpy((uint8_t *)dash->winnerMac, data->button_pressed_mac, 6);
 
-    globalDoorDashStartedAt = millis();
-    globalHasDeclaredWinner = true;
+    dash->startedAt = millis();
+    dash->announced = false;
+    dash->hasDeclaredWinner = true;
   }
 
-  if (globalHasDeclaredWinner) {
-    sendWinner((uint8_t *)WINNER_MAC);
+  if (dash->hasDeclaredWinner) {
+    sendWinner(data->door_id, (uint8_t *)dash->winnerMac);
   }
 }
 
 void buttonCallBackFunction(const uint8_t *senderMac,
                             const uint8_t *incomingData, int len) {
-
+  if (!isOwnGroup(incomingData, len)) {
+    return;
+  }
   DataStruct *data = (DataStruct *)incomingData;
+  TimingConfig *timing = getTimingConfig(data, len);
+  // Timing frames are for every door
+  if ((timing == NULL && data->door_id != DOOR_ID) ||
+      !verifyFrame(senderMac, incomingData, len)) {
+    return;
+  }
+  if (timing != NULL) {
+    if (timing->version > globalTiming.version &&
+        timing->version > globalPendingTiming.version &&
+        isTimingValid(timing)) {
+      globalPendingTiming = *timing;
+    }
+    return;
+  }
+  TelemetryStruct *telemetry = getTelemetry(data, len);
+  if (telemetry != NULL && !isMacAddressSelf(telemetry->node_mac)) {
+    globalRelayedTelemetry = *telemetry;
+    globalHasRelayedTelemetry = true;
+  }
   // Handle state changes, and rebroadcasting
   if (isWinnerMsg(data)) { // WINNER_MSG
     if (globalState == SLEEP_LISTEN || globalState == DOOR_DASH_WAITING) {
+      if (globalState == DOOR_DASH_WAITING) {
+        globalLastLatency__ms = millis() - globalDoorDashStartedAt;
+      }
       memcpy((uint8_t *)WINNER_MAC, data->winner_mac, 6);
       if (isMacAddressSelf(data->winner_mac)) {
         transitionState(DOOR_DASH_WINNER);
@@ -294,30 +1177,22 @@ void buttonCallBackFunction(const uint8_t *senderMac,
   }
 }
 
-void ledWinner() {
-  // Flash LED fast
-  if ((millis() - globalDoorDashStartedAt) %
-          (DOOR_DASH_WINNER_FLASH_FREQUENCY__ms * 2) <
-      DOOR_DASH_WINNER_FLASH_FREQUENCY__ms) {
-    setLed(true);
-  } else {
-    setLed(false);
+// Called on every pass of the button loop. Patterns are timed from the start
+// of the dash.
+void ledShow(LedPatternId_t id) {
+  updateLedUsage();
+  globalLedShowing = true;
+  globalLedPattern = id;
+  uint32_t period__ms = 2 * globalTiming.waitingFlashFrequency__ms;
+  if (id == LED_WINNER) {
+    period__ms = 2 * globalTiming.winnerFlashFrequency__ms;
   }
+  uint8_t phase =
+      (millis() - globalDoorDashStartedAt) % period__ms * 256 / period__ms;
+  uint8_t level = ledLevel(&LED_PATTERNS[id], phase);
+  setLedDuty(LED_GAMMA[level] * ledScale(id));
 }
 
-void ledUnknown() {
-  // Slowly flash LED
-  if ((millis() - globalDoorDashStartedAt) %
-          (DOOR_DASH_WAITING_FLASH_FREQUENCY__ms * 2) <
-      DOOR_DASH_WAITING_FLASH_FREQUENCY__ms) {
-    setLed(true);
-  } else {
-    setLed(false);
-  }
-}
-
-void ledLoser() { setLed(true); }
-
 void runButton(bool btnPressed) {
 
   // pinMode(BUTTON_LED, OUTPUT);
@@ -330,7 +1205,12 @@ void runButton(bool btnPressed) {
     // delay for the setup to happen. Maybe there's some async setup that gets
     // stuck if we have a while(true) loop here. After this line, while (true)
     // loops are fine.
-    delay(50);
+    markPowerEvent(EVENT_LISTEN);
+    delay(globalTiming.listenTime__ms);
+    if (globalVerifiedFrames > 0) {
+      ESP_LOGI(TAG, "Listen window of %u ms:", globalTiming.listenTime__ms);
+      printVerifyStats();
+    }
 
     if (globalState == SLEEP_LISTEN) {
       // Serial::println("Back to sleep");
@@ -346,71 +1226,80 @@ void runButton(bool btnPressed) {
     transitionState(DOOR_DASH_WAITING);
     globalDoorDashStartedAt = millis();
   }
+  if (!readyToSleep) {
+    globalDashCount++;
+  }
+  bool shouldRelay = currentPowerPolicy()->relay;
 
   unsigned long lastBroadcast = 0;
   while (!readyToSleep) {
+    topUpFrameCounters();
     if (globalState == DOOR_DASH_WAITING) {
-      ledUnknown();
+      ledShow(LED_WAITING);
       // Rebroadcast button pressed every 20ms
-      if (millis() - lastBroadcast > DOOR_DASH_REBROADCAST_INTERVAL__ms) {
+      if (millis() - lastBroadcast > globalTiming.rebroadcastInterval__ms) {
         if (btnPressed) {
           uint8_t selfMacAddress[6] = {};
           getMacAddress((uint8_t *)selfMacAddress);
           sendButtonPressed((uint8_t *)selfMacAddress);
-        } else {
+        } else if (shouldRelay) {
           sendButtonPressed((uint8_t *)BUTTON_PRESSED_MAC);
         }
         lastBroadcast = millis();
       }
-      // If more than FLASH_DURATION__ms has passed, cool down
+      // If more than flashDuration__ms has passed, cool down. Should
+      // theoretically never happen as long as the coordinator does its job.
       if (millis() - globalDoorDashStartedAt >
-          FLASH_DURATION__ms) { // Should theoretically never happen as long
-                                // as the coordinator does its job.
+          globalTiming.flashDuration__ms) {
         Serial::println("ERROR, never received a WINNER_MSG before cooldown");
         globalState = DOOR_DASH_COOL_DOWN_UNKNOWN;
+        markStatePowerEvent();
+        globalMissedWinners++;
       }
     } else if (globalState == DOOR_DASH_WINNER) {
-      // Broadcast repeatedly who the winner is
-      if (millis() - lastBroadcast > DOOR_DASH_REBROADCAST_INTERVAL__ms) {
-        sendWinner((uint8_t *)WINNER_MAC);
+      // Broadcast repeatedly that we won. This is our own frame, not a relay,
+      // so it's sent on a low battery too: other buttons rely on it.
+      if (millis() - lastBroadcast > globalTiming.rebroadcastInterval__ms) {
+        sendWinner(DOOR_ID, (uint8_t *)WINNER_MAC);
         lastBroadcast = millis();
       }
-      ledWinner();
+      ledShow(LED_WINNER);
       // If more than 5 seconds have passed, go to cool down state
-      if (millis() - globalDoorDashStartedAt > FLASH_DURATION__ms) {
+      if (millis() - globalDoorDashStartedAt > globalTiming.flashDuration__ms) {
         transitionState(DOOR_DASH_COOL_DOWN_WINNER);
       }
     } else if (globalState == DOOR_DASH_LOSER) {
       // Broadcast repeatedly who the winner is
-      if (millis() - lastBroadcast > DOOR_DASH_REBROADCAST_INTERVAL__ms) {
-        sendWinner((uint8_t *)WINNER_MAC);
+      if (shouldRelay &&
+          millis() - lastBroadcast > globalTiming.rebroadcastInterval__ms) {
+        sendWinner(DOOR_ID, (uint8_t *)WINNER_MAC);
         lastBroadcast = millis();
       }
-      ledLoser();
+      ledShow(LED_LOSER);
       // If more than 5 seconds have passed, go to cool down state
-      if (millis() - globalDoorDashStartedAt > FLASH_DURATION__ms) {
+      if (millis() - globalDoorDashStartedAt > globalTiming.flashDuration__ms) {
         transitionState(DOOR_DASH_COOL_DOWN_LOSER);
       }
     } else if (globalState == DOOR_DASH_COOL_DOWN_WINNER) {
-      ledWinner();
+      ledShow(LED_WINNER);
       // Sleep after cool down period is over
       if (millis() - globalDoorDashStartedAt >
-          FLASH_DURATION__ms + COOL_DOWN__ms) {
+          globalTiming.flashDuration__ms + coolDown__ms()) {
         readyToSleep = true;
       }
     } else if (globalState == DOOR_DASH_COOL_DOWN_LOSER) {
-      ledLoser();
+      ledShow(LED_LOSER);
       // Sleep after cool down period is over
       if (millis() - globalDoorDashStartedAt >
-          FLASH_DURATION__ms + COOL_DOWN__ms) {
+          globalTiming.flashDuration__ms + coolDown__ms()) {
         readyToSleep = true;
       }
     } else { // DOOR_DASH_COOL_DOWN_UNKNOWN
-      ledUnknown();
+      ledShow(LED_UNKNOWN);
 
       // Sleep after cool down period is over
       if (millis() - globalDoorDashStartedAt >
-          FLASH_DURATION__ms + COOL_DOWN__ms) {
+          globalTiming.flashDuration__ms + coolDown__ms()) {
         readyToSleep = true;
       }
     }
@@ -421,12 +1310,32 @@ void runButton(bool btnPressed) {
 void setupCoordinator() {
   // Radio_Init();
 
+  unsigned long lastChargeReport = 0;
+  unsigned long lastTelemetryReport = 0;
   while (true) {
-    if (globalHasDeclaredWinner && millis() - globalDoorDashStartedAt >
-                                       DOOR_DASH_COORDINATION_DURATION__ms) {
-      Serial::println("Resetting after doordash");
-      globalDoorDashStartedAt = 0;
-      globalHasDeclaredWinner = false;
+    topUpFrameCounters();
+    if (millis() - lastChargeReport > CHARGE_REPORT_INTERVAL__ms) {
+      printNodesNeedingCharge();
+      lastChargeReport = millis();
+    }
+    if (millis() - lastTelemetryReport > TELEMETRY_REPORT_INTERVAL__ms) {
+      streamTelemetry();
+      lastTelemetryReport = millis();
+    }
+    for (uint8_t door = 0; door < NUM_DOORS; door++) {
+      DashContext *dash = &globalDashes[door];
+      if (dash->hasDeclaredWinner && !dash->announced) {
+        ESP_LOGI(TAG, "Declare winner for door %d: ", door);
+        printMac(dash->winnerMac);
+        ESP_LOGI(TAG, "\n"); // newline..
+        dash->announced = true;
+      }
+      if (dash->hasDeclaredWinner &&
+          millis() - dash->startedAt > globalTiming.coordinationDuration__ms) {
+        ESP_LOGI(TAG, "Resetting after doordash for door %d", door);
+        dash->startedAt = 0;
+        dash->hasDeclaredWinner = false;
+      }
     }
   }
 }
@@ -436,6 +1345,8 @@ void loop() { Serial::println("ERROR, this should never run"); }
 void app_main() {
   // Initialize NVS
   ESP_ERROR_CHECK(nvs_flash_init());
+  reserveFrameCounters();
+  loadTimingConfig();
   ESP_LOGI(TAG, "Wifi init");
   example_wifi_init();
   ESP_ERROR_CHECK(esp_wifi_start());
@@ -450,14 +1361,26 @@ void app_main() {
     setupCoordinator();
   } else {
     setup_gpio();
-    setLed(false);
+    setupLed();
+    adc_config_t adc_config = {};
+    adc_config.mode = ADC_READ_TOUT_MODE;
+    adc_config.clk_div = 8;
+    ESP_ERROR_CHECK(adc_init(&adc_config));
 
     while (true) {
+      markPowerEvent(EVENT_WAKE);
+      if (globalPendingTiming.version > globalTiming.version) {
+        applyTimingConfig(&globalPendingTiming);
+      }
       bool btnPressed = isButtonPressed();
+      if (globalWakeCount++ % BATTERY_SAMPLE_INTERVAL_WAKES == 0) {
+        sampleBattery();
+      }
       // Radio_Init();
       ESP_ERROR_CHECK(esp_wifi_start());
 
       example_espnow_init();
+      markPowerEvent(EVENT_RADIO_ON);
       runButton(btnPressed);
     }
   }
@@ -3,19 +3,166 @@
 #include <string.h>
 
 // Derives from https://github.com/HarringayMakerSpace/ESP-Now
+#include <EEPROM.h>
 #include <ESP8266WiFi.h>
+#include <MD5Builder.h>
+#include <eboot_command.h>
+#include <flash_utils.h>
 
 #include <ios>
 extern "C" {
 #include <espnow.h>
 #include <user_interface.h>
 }
+extern "C" uint32_t _FS_start;
+
+// Code run from flash stalls on every cache miss. Building with
+// -DHOT_PATH_IN_IRAM (env:nodemcuv2_iram) puts the receive callbacks, the
+// frame checks they run and the wake path up to the radio being on in IRAM
+// instead. IRAM is small and mostly taken by the SDK, so everything else,
+// logging and sleep included, stays in flash. See tools/iram_report.py for
+// what goes where.
+#ifdef HOT_PATH_IN_IRAM
+#define HOT_PATH IRAM_ATTR
+#else
+#define HOT_PATH
+#endif
 
 const int WIFI_CHANNEL = 4;
 const int BUTTON_INPUT = D1;
 const int BUTTON_LED = D2;
+// Battery+ goes to A0 through an extra 130k resistor, on top of the board's
+// 220k/100k divider. That puts 4.5V at the top of the ADC range.
+const int BATTERY_ADC = A0;
+const uint32_t BATTERY_ADC_FULL_SCALE__mv = 4500;
+
+// For power captures, see tools/power_correlate.py. Every power event pulses
+// MARKER_PIN, which goes to a digital input on the current analyzer, and is
+// logged as "EV <micros> <name>" just before sleeping.
+const bool POWER_MARKERS = false;
+const int MARKER_PIN = D5;
+const unsigned long MARKER_PULSE__us = 30;
+const uint8_t MAX_POWER_EVENTS = 32;
+
+const bool IS_COORDINATOR = false; // True for only one device per group
+// A sniffer never sends. It streams every ESP-NOW frame on WIFI_CHANNEL, from
+// any group, to tools/sniff.py. A busy dash is hundreds of frames a second,
+// hence the faster serial port.
+const bool IS_SNIFFER = false;
+const unsigned long SNIFFER_BAUD = 921600;
+const uint8_t SNIFFER_QUEUE_SIZE = 32;
+const unsigned long SNIFFER_STATS_INTERVAL__ms = 10e3;
+// A traffic generator floods the coordinator with pressed frames, spread over
+// every door and TRAFFIC_SENDERS made up pressed buttons, and reports how
+// quickly winner replies come back. tools/stress.py puts the same load on a
+// host build of the coordinator.
+const bool IS_TRAFFIC_GENERATOR = false;
+const unsigned long TRAFFIC_FRAMES_PER_SECOND = 200;
+const uint8_t TRAFFIC_SENDERS = 20;
+const unsigned long TRAFFIC_REPORT_INTERVAL__ms = 1e3;
+const uint8_t TRAFFIC_MAX_LATENCIES = 128; // Per report
+
+// What a node does for the mesh, advertised in every frame it sends
+enum NodeClass_t {
+  NODE_BATTERY_RELAY = 0, // Wakes to listen, relays while in a dash
+  NODE_BATTERY_LEAF = 1,  // Never relays, shortest listen window
+  NODE_MAINS_RELAY = 2,   // Never sleeps, relays every door's dashes
+  NODE_COORDINATOR = 3,
+};
+// Make a button a leaf once a mains relay covers it, or a mains relay if it's
+// plugged in
+const NodeClass_t NODE_CLASS =
+    IS_COORDINATOR ? NODE_COORDINATOR : NODE_BATTERY_RELAY;
+const char *NODE_CLASS_NAMES[] = {"battery relay", "battery leaf",
+                                  "mains relay", "coordinator"};
+
+// Every frame carries the group id, and frames from other groups are dropped
+// before anything else happens. Pick a different value per household so that
+// neighbors running this firmware on the same channel don't wake our buttons.
+const uint16_t GROUP_ID = 0xD00D;
+// Which door this button belongs to. A coordinator runs one dash per door.
+const uint8_t DOOR_ID = 0;
+// Coordinator only: number of doors it serves, with ids 0 to NUM_DOORS - 1
+const uint8_t NUM_DOORS = 1;
+// Mains relays only: they relay doors 0 to RELAY_NUM_DOORS - 1, so they don't
+// need NUM_DOORS set to match the coordinator
+const uint8_t RELAY_NUM_DOORS = 8;
+
+// Every frame ends with a truncated SipHash-2-4 tag over the sender's MAC and
+// the frame. ESP-NOW encryption can't be used with the broadcast peer, so this
+// is what stops forged or replayed winner frames. Must match ESPNOW_LMK in the
+// RTOS build.
+const uint8_t FRAME_KEY[16] = {'l', 'm', 'k', '1', '2', '3', '4', '5',
+                               '6', '7', '8', '9', '0', '1', '2', '3'};
+const uint8_t FRAME_TAG_LEN = 4;
+// Nodes the coordinator keeps telemetry for
+const uint8_t MAX_NODES = 16;
+// Number of senders whose last frame counter we remember: every node, and a
+// few more for neighbors and strangers
+const uint8_t REPLAY_TABLE_SIZE = MAX_NODES + 4;
+// The frame counter has to keep increasing across power loss, so blocks of it
+// are reserved in EEPROM. Costs one flash write per FRAME_COUNTER_RESERVATION
+// frames sent.
+const uint32_t FRAME_COUNTER_RESERVATION = 4096;
+// The main loops reserve the next block this many frames before the ceiling,
+// so the flash write isn't left to sendFrame in a receive callback
+const uint32_t FRAME_COUNTER_LOW_WATER = 256;
+const int EEPROM_FRAME_COUNTER_ADDR = 0;
+const int EEPROM_TIMING_ADDR = 8; // EEPROM_TIMING_MAGIC, then a TimingConfig
+const uint32_t EEPROM_TIMING_MAGIC = 0xD00D7111;
+const size_t EEPROM_SIZE = 64;
+const uint32_t RTC_STATE_MAGIC = 0xD00DDA5D;
 
-const bool IS_COORDINATOR = false; // True for only one device
+// Reading the ADC with the radio on is slow and upsets WiFi, so the battery is
+// only sampled every BATTERY_SAMPLE_INTERVAL_WAKES wakes (about a minute)
+const uint32_t BATTERY_SAMPLE_INTERVAL_WAKES = 30;
+// Below this the ADC isn't wired up (or we're on USB), so assume mains power
+const uint32_t BATTERY_UNKNOWN__mv = 2500;
+const uint32_t BATTERY_SAVER__mv = 3550;
+const uint32_t BATTERY_CRITICAL__mv = 3400;
+// Avoid flapping between modes as the voltage recovers after a dash
+const uint32_t BATTERY_HYSTERESIS__mv = 50;
+// The coordinator flags nodes below this so they get charged before they drop
+// out
+const uint32_t BATTERY_CHARGE_WARNING__mv = 3500;
+const unsigned long CHARGE_REPORT_INTERVAL__ms = 60e3;
+
+// Telemetry rides along on every TELEMETRY_EVERY_N_FRAMES-th frame a button
+// sends during a dash, so it costs no extra wakes and little airtime
+const uint8_t TELEMETRY_EVERY_N_FRAMES = 10;
+// How often the coordinator streams updated telemetry over serial
+const unsigned long TELEMETRY_REPORT_INTERVAL__ms = 1e3;
+// Serial record framing, see tools/telemetry.py
+const uint8_t SERIAL_RECORD_SYNC[2] = {0xD0, 0xDA};
+const uint8_t SERIAL_RECORD_TELEMETRY = 1;
+const uint8_t SERIAL_RECORD_FIRMWARE_OFFER = 2;
+const uint8_t SERIAL_RECORD_FIRMWARE_CHUNK = 3;
+const uint8_t SERIAL_RECORD_FIRMWARE_ACK = 4;
+const uint8_t SERIAL_RECORD_TIMING = 5;
+const uint8_t SERIAL_RECORD_TIMING_ACK = 6;
+const uint8_t SERIAL_RECORD_SNIFFED = 7;
+
+// Firmware updates over ESP-NOW, see tools/fwpush.py
+const uint8_t FIRMWARE_OFFER = 1;
+const uint8_t FIRMWARE_REQUEST = 2;
+const uint8_t FIRMWARE_CHUNK = 3;
+// Delta ops. Anything below FIRMWARE_OP_COPY_OLD is a literal of op + 1 bytes.
+const uint8_t FIRMWARE_OP_COPY_OLD = 0x80;
+const uint8_t FIRMWARE_OP_COPY_NEW = 0x81;
+const uint8_t FIRMWARE_OP_FILL = 0x82;
+// Flash the coordinator sets aside for each chunk it stores
+const int FIRMWARE_CHUNK_SLOT = 256;
+const int FIRMWARE_READ_BLOCK = 64;
+const uint8_t FIRMWARE_REQUEST_QUEUE = 8;
+// Offers need to land inside a button's listen window
+const unsigned long FIRMWARE_OFFER_INTERVAL__ms = 20;
+const unsigned long FIRMWARE_REQUEST_INTERVAL__ms = 20;
+// Longest a button stays awake updating per wake. It resumes on a later wake.
+const unsigned long FIRMWARE_AWAKE_BUDGET__ms = 10e3;
+const unsigned long FIRMWARE_CAMPAIGN_DURATION__ms = 3600e3;
+// A chunk that doesn't apply is requested again. After this many, across
+// wakes, the image is given up on.
+const uint8_t FIRMWARE_MAX_BAD_CHUNKS = 8;
 
 uint8_t BROADCAST_MAC[] = {0xFF, 0xFF, 0xFF,
                            0xFF, 0xFF, 0xFF}; // NULL means send to all peers
@@ -28,24 +175,245 @@ enum States_t {
   DOOR_DASH_COOL_DOWN_WINNER = 5,
   DOOR_DASH_COOL_DOWN_LOSER = 6,
   DOOR_DASH_COOL_DOWN_UNKNOWN = 7,
+  FIRMWARE_UPDATE = 8,
+  MAINS_RELAY = 9,
 } States;
 States_t globalState = SLEEP_LISTEN;
 
-const unsigned long SLEEP_DURATION__us = 2e6;
-const unsigned long LISTEN_TIME__ms = 50;
-const unsigned long DOOR_DASH_REBROADCAST_INTERVAL__ms = 20;
-const unsigned long DOOR_DASH_WAITING_FLASH_FREQUENCY__ms = 500;
-const unsigned long DOOR_DASH_WINNER_FLASH_FREQUENCY__ms = 120;
-const unsigned long DOOR_DASH_COORDINATION_DURATION__ms = 17e3;
-const unsigned long FLASH_DURATION__ms = 5e3;
-const unsigned long COOL_DOWN__ms = 15e3;
+enum TimingProfile_t {
+  PROFILE_BALANCED = 0,
+  PROFILE_LOW_LATENCY = 1,
+  PROFILE_MAX_BATTERY = 2,
+  PROFILE_CUSTOM = 3,
+};
+const char *TIMING_PROFILE_NAMES[] = {"balanced", "low-latency",
+                                      "max-battery", "custom"};
+
+// Timing the coordinator can change over the air, see tools/timing.py.
+// Buttons apply a new one at their next wake and keep it in EEPROM.
+struct __attribute__((packed)) TimingConfig {
+  uint16_t version; // 0 for the built in defaults, higher replaces lower
+  uint8_t profile;  // TimingProfile_t
+  uint32_t sleepDuration__us;
+  uint16_t listenTime__ms;
+  uint16_t rebroadcastInterval__ms;
+  uint16_t waitingFlashFrequency__ms;
+  uint16_t winnerFlashFrequency__ms;
+  uint16_t coordinationDuration__ms;
+  uint16_t flashDuration__ms;
+  uint16_t coolDown__ms;
+};
+const TimingConfig TIMING_PROFILES[] = {
+    // version, profile, sleep, listen, rebroadcast, waiting flash, winner
+    // flash, coordination, flash, cool down
+    {0, PROFILE_BALANCED, 2000000, 50, 20, 500, 120, 17000, 5000, 15000},
+    {0, PROFILE_LOW_LATENCY, 1000000, 50, 10, 500, 120, 17000, 5000, 15000},
+    // Wakes half as often, so dashes run longer to reach everyone
+    {0, PROFILE_MAX_BATTERY, 4000000, 40, 15, 500, 120, 12000, 6000, 5000},
+};
+// The coordinator and mains relays repeat a new config for this long, often
+// enough to land in every listen window
+const unsigned long TIMING_ANNOUNCE_INTERVAL__ms = 15;
+const unsigned long TIMING_ANNOUNCE_DURATION__ms = 120e3;
+
+enum PowerMode_t {
+  POWER_NORMAL = 0,
+  POWER_SAVER = 1,
+  POWER_CRITICAL = 2,
+};
+
+// As the battery sags, sleep longer, stop relaying other nodes' frames and
+// keep the LED on for less time after a dash
+struct PowerPolicy {
+  uint8_t sleepMultiplier;
+  bool relay;
+  uint8_t coolDownDivisor;
+};
+const PowerPolicy POWER_POLICIES[] = {
+    {1, true, 1},  // POWER_NORMAL
+    {2, false, 2}, // POWER_SAVER
+    {4, false, 4}, // POWER_CRITICAL
+};
+
+enum PowerEvent_t {
+  EVENT_WAKE = 0,
+  EVENT_RADIO_ON = 1,
+  EVENT_LISTEN = 2,
+  EVENT_TX = 3, // Sending presses while waiting for a winner
+  EVENT_LED = 4,
+  EVENT_COOL_DOWN = 5,
+  EVENT_SHUTDOWN = 6, // Discharging the capacitor, logging, saving state
+  EVENT_SLEEP = 7,
+  EVENT_RADIO_OFF = 8, // Only the RTOS build turns the radio off on its own
+  EVENT_FIRMWARE = 9,
+};
+const char *POWER_EVENT_NAMES[] = {
+    "wake",     "radio_on", "listen",    "tx",       "led",
+    "cooldown", "shutdown", "sleep",     "radio_off", "firmware"};
+
+struct PowerEvent {
+  uint32_t at__us;
+  PowerEvent_t event;
+};
+PowerEvent globalPowerEvents[MAX_POWER_EVENTS];
+uint8_t globalPowerEventCount = 0;
+
+// The LED is dimmed with PWM. Brightness is 0-255 on a perceptual scale and
+// is gamma corrected on the way to the PWM, so fades look even.
+const uint16_t LED_PWM_RANGE = 1023;
+const uint32_t LED_PWM_FREQUENCY__hz = 1000;
+// PWM duty for each brightness, (level / 255)^2.2 * LED_PWM_RANGE rounded.
+// Kept in flash rather than worked out with powf on every wake.
+const uint16_t LED_GAMMA[256] PROGMEM = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1,
+    1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 5, 5,
+    6, 6, 7, 7, 8, 9, 9, 10, 11, 11, 12, 13,
+    14, 15, 16, 16, 17, 18, 19, 20, 21, 23, 24, 25,
+    26, 27, 28, 30, 31, 32, 34, 35, 36, 38, 39, 41,
+    42, 44, 46, 47, 49, 51, 52, 54, 56, 58, 60, 61,
+    63, 65, 67, 69, 71, 73, 76, 78, 80, 82, 84, 87,
+    89, 91, 94, 96, 98, 101, 103, 106, 109, 111, 114, 117,
+    119, 122, 125, 128, 130, 133, 136, 139, 142, 145, 148, 151,
+    155, 158, 161, 164, 167, 171, 174, 177, 181, 184, 188, 191,
+    195, 198, 202, 206, 209, 213, 217, 221, 225, 228, 232, 236,
+    240, 244, 248, 252, 257, 261, 265, 269, 274, 278, 282, 287,
+    291, 295, 300, 304, 309, 314, 318, 323, 328, 333, 337, 342,
+    347, 352, 357, 362, 367, 372, 377, 382, 387, 393, 398, 403,
+    408, 414, 419, 425, 430, 436, 441, 447, 452, 458, 464, 470,
+    475, 481, 487, 493, 499, 505, 511, 517, 523, 529, 535, 542,
+    548, 554, 561, 567, 573, 580, 586, 593, 599, 606, 613, 619,
+    626, 633, 640, 647, 653, 660, 667, 674, 681, 689, 696, 703,
+    710, 717, 725, 732, 739, 747, 754, 762, 769, 777, 784, 792,
+    800, 807, 815, 823, 831, 839, 847, 855, 863, 871, 879, 887,
+    895, 903, 912, 920, 928, 937, 945, 954, 962, 971, 979, 988,
+    997, 1005, 1014, 1023,
+};
+// Current through the LED when it's fully on, set by its resistor. Turns duty
+// cycles into current and charge.
+const uint32_t LED_FULL_CURRENT__ua = 20000;
+
+enum LedPatternId_t {
+  LED_WAITING = 0,
+  LED_WINNER = 1,
+  LED_LOSER = 2,
+  LED_UNKNOWN = 3, // Never heard a winner
+  NUM_LED_PATTERNS = 4,
+};
+
+enum LedShape_t {
+  LED_SOLID = 0,
+  LED_BLINK = 1,   // Low for the first half of the period, then high
+  LED_BREATHE = 2, // Fades from low to high and back
+};
+
+// The winner pattern's period is twice winnerFlashFrequency__ms, the others
+// twice waitingFlashFrequency__ms. A pattern whose average current would go
+// over its budget is dimmed as a whole until it fits. Patterns start low, so
+// one cut short part way through a period doesn't go over either.
+struct LedPattern {
+  const char *name;
+  LedShape_t shape;
+  uint8_t high;
+  uint8_t low;
+  uint32_t budget__ua; // 0 for no budget
+};
+const LedPattern LED_PATTERNS[NUM_LED_PATTERNS] = {
+    {"waiting", LED_BREATHE, 255, 16, 4000},
+    {"winner", LED_BLINK, 255, 0, 8000},
+    // Lit for the whole dash, so dim
+    {"loser", LED_SOLID, 80, 80, 2000},
+    {"unknown", LED_BLINK, 96, 0, 1000},
+};
+
+// How long each pattern was shown this dash, and the charge it used
+struct LedUsage {
+  uint32_t shown__us;
+  uint64_t charge__pc; // uA * us
+};
+// Fits each pattern in its budget, 0 until the pattern is first shown
+float globalLedScale[NUM_LED_PATTERNS] = {};
+LedUsage globalLedUsage[NUM_LED_PATTERNS] = {};
+LedPatternId_t globalLedPattern = LED_WAITING;
+bool globalLedShowing = false;
+uint16_t globalLedDuty = 0;
+uint32_t globalLedUpdatedAt__us = 0;
 
 unsigned long globalDoorDashStartedAt = 0;
-bool globalHasDeclaredWinner = false;
 uint8_t winnerMac[6] = {0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU};
 uint8_t BUTTON_PRESSED_MAC[6] = {0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU};
 
+// Coordinator state for one door. Each door runs its own independent dash.
+struct DashContext {
+  bool hasDeclaredWinner;
+  bool announced; // The winner was printed, by the loop
+  unsigned long startedAt;
+  uint8_t winnerMac[6];
+};
+DashContext globalDashes[NUM_DOORS] = {};
+
+struct ReplayEntry {
+  uint8_t mac[6];
+  uint32_t counter;
+  uint32_t heardAt__ms; // replayClock__ms()
+};
+
+// Kept in RTC user memory so that it survives deep sleep
+struct RtcState {
+  uint32_t magic;
+  uint32_t frameCounter;
+  uint32_t frameCounterCeiling;
+  uint32_t clock__ms; // Time awake and asleep before this wake
+  ReplayEntry replay[REPLAY_TABLE_SIZE];
+  uint32_t wakeCount;
+  uint32_t battery__mv; // Filtered, 0 if unknown
+  uint32_t powerMode;
+  // Telemetry counters, see TelemetryStruct
+  uint32_t dashes;
+  uint32_t txFrames;
+  uint32_t rxFrames;
+  uint32_t missedWinners;
+  uint32_t lastLatency__ms;
+  // Firmware update progress, see flushFirmwareSector()
+  uint16_t otaImageId;
+  uint16_t otaResumeChunk;
+  uint32_t otaFlushed;
+  uint16_t otaIgnoredImageId;
+  uint8_t otaBadChunks;
+  bool hasSketchMd5; // Cleared on every boot that isn't a wake from sleep
+  uint8_t sketchMd5[16];
+  TimingConfig timing;
+  TimingConfig pendingTiming; // Heard this wake, applied at the next one
+};
+RtcState rtcState;
+static_assert(sizeof(RtcState) <= 512, "RTC user memory is 512 bytes");
+
+uint8_t selfMac[6] = {};
+// Time spent verifying frames since the last wake, to check that
+// authentication doesn't eat into listenTime__ms()
+uint32_t globalVerifyCycles = 0;
+uint32_t globalVerifiedFrames = 0;
+// Cycle counts for comparing HOT_PATH placements, see printCycleStats()
+uint32_t globalSetupStartCycles = 0; // Since the chip reset
+uint32_t globalRadioOnCycles = 0;
+uint32_t globalCallbackCycles = 0;
+uint32_t globalMaxCallbackCycles = 0;
+uint32_t globalCallbacks = 0;
+
+const uint8_t FRAME_HAS_TELEMETRY = 1 << 0;
+const uint8_t FRAME_FIRMWARE = 1 << 1; // Followed by a FirmwareStruct
+// Sender's NodeClass_t. Older firmware leaves it 0, a battery relay.
+const uint8_t FRAME_NODE_CLASS_SHIFT = 2;
+const uint8_t FRAME_NODE_CLASS_MASK = 3 << FRAME_NODE_CLASS_SHIFT;
+const uint8_t FRAME_TIMING = 1 << 4; // Followed by a TimingConfig
+
 struct __attribute__((packed)) DataStruct {
+  uint16_t group_id;
+  uint8_t door_id;
+  uint32_t counter; // Strictly increasing per sender, to reject replays
+  uint8_t battery;  // Sender's battery, see encodeBattery()
+  uint8_t flags; // FRAME_HAS_TELEMETRY, FRAME_FIRMWARE, FRAME_NODE_CLASS_MASK,
+                 // FRAME_TIMING
+
   // Device sending to master that the device's button was pressed
   uint8_t button_pressed_mac[6]; // PRESSED_MSG
 
@@ -53,6 +421,55 @@ struct __attribute__((packed)) DataStruct {
   uint8_t winner_mac[6]; // WINNER_MSG
 };
 
+// Counters a button reports about itself. Counters wrap rather than saturate.
+// Relays forward other buttons' telemetry too, so node_mac isn't necessarily
+// the sender.
+struct __attribute__((packed)) TelemetryStruct {
+  uint8_t node_mac[6];
+  uint16_t wakes;
+  uint16_t dashes;
+  uint16_t tx_frames;
+  uint16_t rx_frames;
+  uint8_t missed_winners;    // Dashes that ended without hearing a winner
+  uint16_t last_latency__ms; // From the start of the dash to hearing a winner
+  uint8_t battery;
+  uint16_t timing_version; // TimingConfig in use
+};
+
+struct __attribute__((packed)) FirmwareStruct {
+  uint8_t kind; // FIRMWARE_OFFER, FIRMWARE_REQUEST or FIRMWARE_CHUNK
+  uint16_t image_id;
+  uint16_t chunk; // Requested or contained chunk, chunk count for offers
+  // Followed by a FirmwareOffer, or for chunks the uint32_t output offset
+  // and then delta ops
+};
+
+struct __attribute__((packed)) FirmwareOffer {
+  uint32_t image_size;
+  uint16_t chunk_count;
+  uint8_t image_md5[16];
+  uint8_t base_md5[16]; // The running image the delta applies to
+};
+
+const int MAX_FRAME_LEN = 250; // ESP-NOW's limit
+const int FIRMWARE_CHUNK_MAX_BODY =
+    MAX_FRAME_LEN - sizeof(DataStruct) - sizeof(FirmwareStruct) - FRAME_TAG_LEN;
+
+// Most recent telemetry from another button, waiting to be forwarded
+TelemetryStruct globalRelayedTelemetry = {};
+bool globalHasRelayedTelemetry = false;
+uint8_t globalFramesUntilTelemetry = 0;
+
+// Coordinator only: latest telemetry from each node
+struct NodeTelemetry {
+  TelemetryStruct telemetry;
+  bool updated; // Since it was last streamed over serial
+  bool heard;     // Directly, rather than through forwarded telemetry
+  bool announced; // Its class was printed, by the loop
+  uint8_t nodeClass;
+};
+NodeTelemetry globalNodes[MAX_NODES] = {};
+
 /* While the capacitor is charged, the button will not be able to reset the
  * ESP*/
 void keepCapacitorCharged() {
@@ -60,136 +477,1521 @@ void keepCapacitorCharged() {
   digitalWrite(BUTTON_INPUT, HIGH); // Prevent button from resetting
 }
 
-/* Before going to sleep, the capacitor needs to discharge so that we don't
- * prevent the button from waking the ESP back up.*/
-void goToSleep() {
-  pinMode(BUTTON_INPUT, OUTPUT);
-  digitalWrite(BUTTON_INPUT, LOW); // Discharge capacitor
-  delay(5);
+// Rejects configs that would stop dashes from reaching sleeping buttons
+bool isTimingValid(const TimingConfig *config) {
+  // Leaves listen for half of listenTime__ms and must still hear a rebroadcast
+  return config->profile <= PROFILE_CUSTOM &&
+         config->sleepDuration__us >= 100e3 &&
+         config->sleepDuration__us <= 60e6 &&
+         config->rebroadcastInterval__ms >= 5 &&
+         config->listenTime__ms / 2 > config->rebroadcastInterval__ms &&
+         config->flashDuration__ms * 1000UL >= config->sleepDuration__us &&
+         config->waitingFlashFrequency__ms > 0 &&
+         config->winnerFlashFrequency__ms > 0 &&
+         config->coordinationDuration__ms > config->flashDuration__ms;
+}
+
+void loadTimingConfig() {
+  uint32_t magic = 0;
+  EEPROM.begin(EEPROM_SIZE);
+  EEPROM.get(EEPROM_TIMING_ADDR, magic);
+  EEPROM.get(EEPROM_TIMING_ADDR + sizeof(magic), rtcState.timing);
+  EEPROM.end();
+  if (magic != EEPROM_TIMING_MAGIC || !isTimingValid(&rtcState.timing)) {
+    rtcState.timing = TIMING_PROFILES[PROFILE_BALANCED];
+  }
+}
+
+void applyTimingConfig(const TimingConfig *config) {
+  rtcState.timing = *config;
+  EEPROM.begin(EEPROM_SIZE);
+  EEPROM.put(EEPROM_TIMING_ADDR, EEPROM_TIMING_MAGIC);
+  EEPROM.put(EEPROM_TIMING_ADDR + sizeof(EEPROM_TIMING_MAGIC), *config);
+  EEPROM.end();
+}
+
+HOT_PATH void loadRtcState() {
+  ESP.rtcUserMemoryRead(0, (uint32_t *)&rtcState, sizeof(rtcState));
+  if (rtcState.magic != RTC_STATE_MAGIC) { // Cold boot
+    memset(&rtcState, 0, sizeof(rtcState));
+    rtcState.magic = RTC_STATE_MAGIC;
+    loadTimingConfig();
+  }
+  if (ESP.getResetInfoPtr()->reason != REASON_DEEP_SLEEP_AWAKE) {
+    rtcState.hasSketchMd5 = false; // Could have been flashed since
+  }
+}
+
+void saveRtcState() {
+  ESP.rtcUserMemoryWrite(0, (uint32_t *)&rtcState, sizeof(rtcState));
+}
+
+const PowerPolicy *currentPowerPolicy() {
+  return &POWER_POLICIES[rtcState.powerMode];
+}
+
+// Milliseconds since a cold boot, counting deep sleep, so replay entries can
+// be aged across wakes
+HOT_PATH uint32_t replayClock__ms() { return rtcState.clock__ms + millis(); }
+
+// Capped at the flash duration, or a node sleeping longer in a power saving
+// mode could sleep through a whole dash
+unsigned long sleepDuration__us() {
+  unsigned long sleep__us =
+      rtcState.timing.sleepDuration__us * currentPowerPolicy()->sleepMultiplier;
+  unsigned long flash__us = rtcState.timing.flashDuration__ms * 1000UL;
+  return sleep__us < flash__us ? sleep__us : flash__us;
+}
+
+unsigned long coolDown__ms() {
+  return rtcState.timing.coolDown__ms / currentPowerPolicy()->coolDownDivisor;
+}
+
+// Mains relays repeat dash frames too, so a leaf hears one sooner
+unsigned long listenTime__ms() {
+  if (NODE_CLASS == NODE_BATTERY_LEAF) {
+    return rtcState.timing.listenTime__ms / 2;
+  }
+  return rtcState.timing.listenTime__ms;
+}
+
+// Leaves leave relaying to the relays, as do buttons with a low battery
+bool isRelaying() {
+  return NODE_CLASS != NODE_BATTERY_LEAF && currentPowerPolicy()->relay;
+}
+
+void updatePowerMode() {
+  uint32_t mv = rtcState.battery__mv;
+  // Only step down below a threshold, only step back up once clear of it
+  uint32_t margin = BATTERY_HYSTERESIS__mv;
+  if (mv == 0) {
+    rtcState.powerMode = POWER_NORMAL;
+  } else if (mv < BATTERY_CRITICAL__mv) {
+    rtcState.powerMode = POWER_CRITICAL;
+  } else if (mv < BATTERY_SAVER__mv) {
+    if (rtcState.powerMode != POWER_CRITICAL ||
+        mv > BATTERY_CRITICAL__mv + margin) {
+      rtcState.powerMode = POWER_SAVER;
+    }
+  } else if (rtcState.powerMode == POWER_NORMAL ||
+             mv > BATTERY_SAVER__mv + margin) {
+    rtcState.powerMode = POWER_NORMAL;
+  } else if (rtcState.powerMode == POWER_CRITICAL) {
+    rtcState.powerMode = POWER_SAVER;
+  }
+}
+
+void sampleBattery() {
+  uint32_t mv = analogRead(BATTERY_ADC) * BATTERY_ADC_FULL_SCALE__mv / 1023;
+  if (mv < BATTERY_UNKNOWN__mv) {
+    rtcState.battery__mv = 0;
+  } else if (rtcState.battery__mv == 0) {
+    rtcState.battery__mv = mv;
+  } else { // Smooth out ADC noise and the sag while the radio is on
+    rtcState.battery__mv = (rtcState.battery__mv * 3 + mv) / 4;
+  }
+  updatePowerMode();
+}
+
+// Battery voltage in 10mV steps above 2V, so it fits in a byte. 0 if unknown.
+uint8_t encodeBattery(uint32_t mv) {
+  if (mv < 2000) {
+    return 0;
+  }
+  uint32_t steps = (mv - 2000) / 10;
+  return steps > 255 ? 255 : steps;
+}
+
+uint32_t decodeBattery(uint8_t battery) {
+  return battery == 0 ? 0 : 2000 + battery * 10;
+}
+
+void printVerifyStats() {
+  Serial.printf("Verified %u frames in %u us\n", globalVerifiedFrames,
+                globalVerifyCycles / ESP.getCpuFreqMHz());
+}
+
+void printCycleStats() {
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  Serial.printf("Reset to setup %u us, setup to radio on %u us\n",
+                globalSetupStartCycles / mhz,
+                (globalRadioOnCycles - globalSetupStartCycles) / mhz);
+  if (globalCallbacks > 0) {
+    Serial.printf("%u callbacks, mean %u us, max %u us\n", globalCallbacks,
+                  globalCallbackCycles / globalCallbacks / mhz,
+                  globalMaxCallbackCycles / mhz);
+  }
+}
+
+// Brightness of a pattern at a phase of 0-255 through its period
+uint8_t ledLevel(const LedPattern *pattern, uint8_t phase) {
+  switch (pattern->shape) {
+  case LED_BLINK:
+    return phase < 128 ? pattern->low : pattern->high;
+  case LED_BREATHE: {
+    uint8_t ramp = phase < 128 ? phase * 2 : 255 - (phase - 128) * 2;
+    return pattern->low + (pattern->high - pattern->low) * ramp / 255;
+  }
+  default:
+    return pattern->high;
+  }
+}
+
+uint32_t ledCurrent__ua(uint16_t duty) {
+  return (uint64_t)duty * LED_FULL_CURRENT__ua / LED_PWM_RANGE;
+}
+
+uint16_t ledGamma(uint8_t level) { return pgm_read_word(&LED_GAMMA[level]); }
+
+// Worked out the first time a pattern is shown, so wakes without a dash don't
+// pay for it. Duties are rounded down after scaling, so the pattern averages
+// at most its budget.
+float ledScale(LedPatternId_t id) {
+  if (globalLedScale[id] == 0) {
+    const LedPattern *pattern = &LED_PATTERNS[id];
+    uint32_t duty = 0;
+    for (int phase = 0; phase < 256; phase++) {
+      duty += ledGamma(ledLevel(pattern, phase));
+    }
+    float average__ua =
+        (float)duty / 256 * LED_FULL_CURRENT__ua / LED_PWM_RANGE;
+    globalLedScale[id] = 1;
+    if (pattern->budget__ua > 0 && average__ua > pattern->budget__ua) {
+      globalLedScale[id] = pattern->budget__ua / average__ua;
+    }
+  }
+  return globalLedScale[id];
+}
+
+void setupLed() {
+  pinMode(BUTTON_LED, OUTPUT);
+  analogWriteRange(LED_PWM_RANGE);
+  analogWriteFreq(LED_PWM_FREQUENCY__hz);
+  analogWrite(BUTTON_LED, 0);
+}
+
+// Charges the time since the last update to the pattern that was showing
+void updateLedUsage() {
+  uint32_t now__us = micros();
+  if (globalLedShowing) {
+    uint32_t elapsed__us = now__us - globalLedUpdatedAt__us;
+    LedUsage *usage = &globalLedUsage[globalLedPattern];
+    usage->shown__us += elapsed__us;
+    usage->charge__pc += (uint64_t)ledCurrent__ua(globalLedDuty) * elapsed__us;
+  }
+  globalLedUpdatedAt__us = now__us;
+}
+
+void setLedDuty(uint16_t duty) {
+  if (duty != globalLedDuty) {
+    analogWrite(BUTTON_LED, duty);
+    globalLedDuty = duty;
+  }
+}
+
+// Called on every pass of the button loop. Patterns are timed from the start
+// of the dash.
+void ledShow(LedPatternId_t id) {
+  updateLedUsage();
+  globalLedShowing = true;
+  globalLedPattern = id;
+  unsigned long period__ms = 2 * rtcState.timing.waitingFlashFrequency__ms;
+  if (id == LED_WINNER) {
+    period__ms = 2 * rtcState.timing.winnerFlashFrequency__ms;
+  }
+  uint8_t phase =
+      (millis() - globalDoorDashStartedAt) % period__ms * 256 / period__ms;
+  uint8_t level = ledLevel(&LED_PATTERNS[id], phase);
+  setLedDuty(ledGamma(level) * ledScale(id));
+}
+
+void ledOff() {
+  updateLedUsage();
+  globalLedShowing = false;
+  setLedDuty(0);
+}
+
+void printLedReport() {
+  for (int i = 0; i < NUM_LED_PATTERNS; i++) {
+    LedUsage *usage = &globalLedUsage[i];
+    if (usage->shown__us < 1000) {
+      continue;
+    }
+    uint32_t charge__uc = usage->charge__pc / 1000000;
+    Serial.printf("LED %s: %u ms, %u uC, average %u uA (budget %u uA)\n",
+                  LED_PATTERNS[i].name, usage->shown__us / 1000, charge__uc,
+                  (uint32_t)(usage->charge__pc / usage->shown__us),
+                  LED_PATTERNS[i].budget__ua);
+  }
+  memset(globalLedUsage, 0, sizeof(globalLedUsage));
+}
+
+// Once the log is full, events are neither logged nor pulsed, so that pulses
+// and log lines still pair up
+void markPowerEvent(PowerEvent_t event) {
+  if (!POWER_MARKERS || globalPowerEventCount == MAX_POWER_EVENTS) {
+    return;
+  }
+  digitalWrite(MARKER_PIN, HIGH);
+  globalPowerEvents[globalPowerEventCount].at__us = micros();
+  globalPowerEvents[globalPowerEventCount].event = event;
+  globalPowerEventCount++;
+  delayMicroseconds(MARKER_PULSE__us);
+  digitalWrite(MARKER_PIN, LOW);
+}
+
+void printPowerEvents() {
+  if (!POWER_MARKERS) {
+    return;
+  }
+  if (!Serial) {
+    Serial.begin(115200);
+  }
+  for (int i = 0; i < globalPowerEventCount; i++) {
+    Serial.printf("EV %u %s\n", globalPowerEvents[i].at__us,
+                  POWER_EVENT_NAMES[globalPowerEvents[i].event]);
+  }
+  globalPowerEventCount = 0;
+  Serial.flush();
+}
+
+/* Before going to sleep, the capacitor needs to discharge so that we don't
+ * prevent the button from waking the ESP back up.*/
+void goToSleep() {
+  markPowerEvent(EVENT_SHUTDOWN);
+  ledOff();
+  pinMode(BUTTON_INPUT, OUTPUT);
+  digitalWrite(BUTTON_INPUT, LOW); // Discharge capacitor
+  delay(5);
+
+  if (Serial) {
+    printVerifyStats();
+    printCycleStats();
+    printLedReport();
+    Serial.println("Going to sleep");
+  }
+  printPowerEvents();
+  rtcState.clock__ms = replayClock__ms();
+  if (NODE_CLASS != NODE_MAINS_RELAY) {
+    rtcState.clock__ms += sleepDuration__us() / 1000;
+  }
+  saveRtcState();
+  if (NODE_CLASS == NODE_MAINS_RELAY) {
+    ESP.restart(); // Straight back to relaying
+  }
+  // Printing this last line shows up as the first few ms of sleep
+  markPowerEvent(EVENT_SLEEP);
+  printPowerEvents();
+  ESP.deepSleepInstant(sleepDuration__us(), WAKE_NO_RFCAL);
+}
+
+// Cheap filter that runs before any other work in the receive callbacks
+HOT_PATH bool isOwnGroup(uint8_t *incomingData, uint8_t len) {
+  return len >= sizeof(DataStruct) + FRAME_TAG_LEN && len <= MAX_FRAME_LEN &&
+         ((DataStruct *)incomingData)->group_id == GROUP_ID;
+}
+
+HOT_PATH NodeClass_t getNodeClass(DataStruct *data) {
+  return (NodeClass_t)((data->flags & FRAME_NODE_CLASS_MASK) >>
+                       FRAME_NODE_CLASS_SHIFT);
+}
+
+HOT_PATH bool isMacEmpty(uint8_t *mac) {
+  for (int i = 0; i < 6; i++) {
+    if (mac[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+HOT_PATH bool isWinnerMsg(DataStruct *data) {
+  for (int i = 0; i < 6; i++) {
+    if (data->winner_mac[i] != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void waitForSerial() {
+  while (!Serial) {
+    delay(1);
+  }
+}
+
+void callWatchdog() { yield(); }
+
+void setupSerial() {
+  Serial.begin(115200);
+  waitForSerial();
+  Serial.println("Hello world!");
+}
+
+void markStatePowerEvent() {
+  switch (globalState) {
+  case DOOR_DASH_WAITING:
+    markPowerEvent(EVENT_TX);
+    break;
+  case DOOR_DASH_WINNER:
+  case DOOR_DASH_LOSER:
+    markPowerEvent(EVENT_LED);
+    break;
+  case DOOR_DASH_COOL_DOWN_WINNER:
+  case DOOR_DASH_COOL_DOWN_LOSER:
+  case DOOR_DASH_COOL_DOWN_UNKNOWN:
+    markPowerEvent(EVENT_COOL_DOWN);
+    break;
+  case FIRMWARE_UPDATE:
+    markPowerEvent(EVENT_FIRMWARE);
+    break;
+  default:
+    break;
+  }
+}
+
+void transitionState(States_t newState) {
+  globalState = newState;
+  markStatePowerEvent();
+
+  switch (newState) {
+  case SLEEP_LISTEN:
+    Serial.println("Transitioned to SLEEP_LISTEN");
+    break;
+  case DOOR_DASH_WAITING:
+    Serial.println("Transitioned to DOOR_DASH_WAITING");
+    break;
+  case DOOR_DASH_WINNER:
+    Serial.println("Transitioned to DOOR_DASH_WINNER");
+    break;
+  case DOOR_DASH_LOSER:
+    Serial.println("Transitioned to DOOR_DASH_LOSER");
+    break;
+  case DOOR_DASH_COOL_DOWN_WINNER:
+    Serial.println("Transitioned to DOOR_DASH_COOL_DOWN_WINNER");
+    break;
+  case DOOR_DASH_COOL_DOWN_LOSER:
+    Serial.println("Transitioned to DOOR_DASH_COOL_DOWN_LOSER");
+    break;
+  case DOOR_DASH_COOL_DOWN_UNKNOWN:
+    Serial.println("Transitioned to DOOR_DASH_COOL_DOWN_UNKNOWN");
+    break;
+  case FIRMWARE_UPDATE:
+    Serial.println("Transitioned to FIRMWARE_UPDATE");
+    break;
+  case MAINS_RELAY:
+    Serial.println("Transitioned to MAINS_RELAY");
+    break;
+  default:
+    Serial.println("Transitioned to ERROR, unknown state");
+    break;
+  }
+}
+
+void printMac(uint8_t *macaddr) {
+  for (byte n = 0; n < 6; n++) {
+    Serial.print(macaddr[n], HEX);
+  }
+}
+
+void setMacAddress(uint8_t *mac) { WiFi.macAddress(mac); }
+
+#define SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND                                                              \
+  do {                                                                         \
+    v0 += v1;                                                                  \
+    v1 = SIP_ROTL(v1, 13);                                                     \
+    v1 ^= v0;                                                                  \
+    v0 = SIP_ROTL(v0, 32);                                                     \
+    v2 += v3;                                                                  \
+    v3 = SIP_ROTL(v3, 16);                                                     \
+    v3 ^= v2;                                                                  \
+    v0 += v3;                                                                  \
+    v3 = SIP_ROTL(v3, 21);                                                     \
+    v3 ^= v0;                                                                  \
+    v2 += v1;                                                                  \
+    v1 = SIP_ROTL(v1, 17);                                                     \
+    v1 ^= v2;                                                                  \
+    v2 = SIP_ROTL(v2, 32);                                                     \
+  } while (0)
+
+HOT_PATH uint64_t readLe64(const uint8_t *p, int len) {
+  uint64_t value = 0;
+  for (int i = len - 1; i >= 0; i--) {
+    value = (value << 8) | p[i];
+  }
+  return value;
+}
+
+// SipHash-2-4, see https://www.aumasson.jp/siphash/siphash.pdf
+HOT_PATH uint64_t sipHash24(const uint8_t *key, const uint8_t *in, int len) {
+  uint64_t k0 = readLe64(key, 8);
+  uint64_t k1 = readLe64(key + 8, 8);
+  uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+  uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+  uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+  uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+  int end = len - (len % 8);
+  for (int i = 0; i < end; i += 8) {
+    uint64_t m = readLe64(in + i, 8);
+    v3 ^= m;
+    SIP_ROUND;
+    SIP_ROUND;
+    v0 ^= m;
+  }
+  uint64_t last = ((uint64_t)len << 56) | readLe64(in + end, len - end);
+  v3 ^= last;
+  SIP_ROUND;
+  SIP_ROUND;
+  v0 ^= last;
+
+  v2 ^= 0xff;
+  SIP_ROUND;
+  SIP_ROUND;
+  SIP_ROUND;
+  SIP_ROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// The tag covers the sender's MAC so that a captured frame can't be replayed
+// under a different sender address with a fresh replay table entry
+HOT_PATH void computeTag(const uint8_t *mac, const uint8_t *frame, int len,
+                         uint8_t *tag) {
+  uint8_t message[6 + MAX_FRAME_LEN];
+  memcpy(message, mac, 6);
+  memcpy(message + 6, frame, len);
+  uint64_t hash = sipHash24(FRAME_KEY, message, 6 + len);
+  for (int i = 0; i < FRAME_TAG_LEN; i++) {
+    tag[i] = hash >> (8 * i);
+  }
+}
+
+/* Frame counters are reserved in blocks so that EEPROM is only written once
+ * every FRAME_COUNTER_RESERVATION frames, and after a cold boot. */
+void reserveFrameCounters() {
+  EEPROM.begin(EEPROM_SIZE);
+  uint32_t reserved = 0;
+  EEPROM.get(EEPROM_FRAME_COUNTER_ADDR, reserved);
+  if (reserved == 0xFFFFFFFF) { // Never written
+    reserved = 0;
+  }
+  // After a cold boot anything below the stored ceiling may have been sent. A
+  // top up from the loop keeps its counter, the ceiling is still its own.
+  if (rtcState.frameCounterCeiling != reserved &&
+      rtcState.frameCounter < reserved) {
+    rtcState.frameCounter = reserved;
+  }
+  rtcState.frameCounterCeiling =
+      rtcState.frameCounter + FRAME_COUNTER_RESERVATION;
+  EEPROM.put(EEPROM_FRAME_COUNTER_ADDR, rtcState.frameCounterCeiling);
+  EEPROM.end();
+}
+
+// Called from the main loops, outside any callback
+void topUpFrameCounters() {
+  if (rtcState.frameCounter + FRAME_COUNTER_LOW_WATER >=
+      rtcState.frameCounterCeiling) {
+    reserveFrameCounters();
+  }
+}
+
+HOT_PATH uint32_t nextFrameCounter() {
+  if (rtcState.frameCounter >= rtcState.frameCounterCeiling) {
+    reserveFrameCounters(); // Only if the loop hasn't run, such as in a burst
+  }
+  return rtcState.frameCounter++;
+}
+
+// A new sender takes the slot of the one heard least recently. A sender heard
+// within the last dash is never evicted, since its captured frames would then
+// be accepted again; a new sender is dropped instead until a slot frees up.
+HOT_PATH bool isReplay(uint8_t *senderMac, uint32_t counter) {
+  uint32_t now__ms = replayClock__ms();
+  ReplayEntry *oldest = NULL;
+  uint32_t oldestAge__ms = 0;
+  for (int i = 0; i < REPLAY_TABLE_SIZE; i++) {
+    ReplayEntry *entry = &rtcState.replay[i];
+    if (memcmp(entry->mac, senderMac, 6) == 0) {
+      if (counter <= entry->counter) {
+        return true;
+      }
+      entry->counter = counter;
+      entry->heardAt__ms = now__ms;
+      return false;
+    }
+    uint32_t age__ms =
+        isMacEmpty(entry->mac) ? UINT32_MAX : now__ms - entry->heardAt__ms;
+    if (oldest == NULL || age__ms > oldestAge__ms) {
+      oldest = entry;
+      oldestAge__ms = age__ms;
+    }
+  }
+  if (oldestAge__ms < rtcState.timing.coordinationDuration__ms) {
+    return true;
+  }
+  memcpy(oldest->mac, senderMac, 6);
+  oldest->counter = counter;
+  oldest->heardAt__ms = now__ms;
+  return false;
+}
+
+HOT_PATH bool verifyFrame(uint8_t *senderMac, uint8_t *incomingData,
+                          uint8_t len) {
+  uint32_t start = ESP.getCycleCount();
+  uint8_t tag[FRAME_TAG_LEN];
+  int tagOffset = len - FRAME_TAG_LEN;
+  computeTag(senderMac, incomingData, tagOffset, tag);
+  uint8_t diff = 0;
+  for (int i = 0; i < FRAME_TAG_LEN; i++) {
+    diff |= tag[i] ^ incomingData[tagOffset + i];
+  }
+  bool valid =
+      diff == 0 && !isReplay(senderMac, ((DataStruct *)incomingData)->counter);
+  globalVerifyCycles += ESP.getCycleCount() - start;
+  globalVerifiedFrames++;
+  if (valid) {
+    rtcState.rxFrames++;
+  }
+  return valid;
+}
+
+HOT_PATH TelemetryStruct *getTelemetry(DataStruct *data, uint8_t len) {
+  if ((data->flags & FRAME_HAS_TELEMETRY) &&
+      len == sizeof(DataStruct) + sizeof(TelemetryStruct) + FRAME_TAG_LEN) {
+    return (TelemetryStruct *)((uint8_t *)data + sizeof(DataStruct));
+  }
+  return NULL;
+}
+
+HOT_PATH void fillOwnTelemetry(TelemetryStruct *telemetry) {
+  memcpy(telemetry->node_mac, selfMac, 6);
+  telemetry->wakes = rtcState.wakeCount;
+  telemetry->dashes = rtcState.dashes;
+  telemetry->tx_frames = rtcState.txFrames;
+  telemetry->rx_frames = rtcState.rxFrames;
+  telemetry->missed_winners = rtcState.missedWinners;
+  telemetry->last_latency__ms = rtcState.lastLatency__ms;
+  telemetry->battery = encodeBattery(rtcState.battery__mv);
+  telemetry->timing_version = rtcState.timing.version;
+}
+
+// Alternates between our own telemetry and forwarding the last one we heard,
+// so buttons out of the coordinator's range still get reported
+HOT_PATH bool nextTelemetry(TelemetryStruct *telemetry) {
+  if (IS_COORDINATOR || globalFramesUntilTelemetry-- > 0) {
+    return false;
+  }
+  globalFramesUntilTelemetry = TELEMETRY_EVERY_N_FRAMES - 1;
+  static bool forwardNext = false;
+  if (forwardNext && globalHasRelayedTelemetry && isRelaying()) {
+    *telemetry = globalRelayedTelemetry;
+    globalHasRelayedTelemetry = false;
+  } else {
+    fillOwnTelemetry(telemetry);
+  }
+  forwardNext = !forwardNext;
+  return true;
+}
+
+// body goes after the header. Frames without one may carry telemetry instead.
+HOT_PATH void sendFrame(DataStruct *data, const uint8_t *body = NULL,
+                        int bodyLen = 0) {
+  uint8_t frame[MAX_FRAME_LEN];
+  int len = sizeof(DataStruct);
+  data->counter = nextFrameCounter();
+  data->battery = encodeBattery(rtcState.battery__mv);
+  data->flags |= NODE_CLASS << FRAME_NODE_CLASS_SHIFT;
+  TelemetryStruct telemetry;
+  if (body != NULL) {
+    memcpy(frame + len, body, bodyLen);
+    len += bodyLen;
+  } else if (nextTelemetry(&telemetry)) {
+    data->flags |= FRAME_HAS_TELEMETRY;
+    memcpy(frame + len, &telemetry, sizeof(telemetry));
+    len += sizeof(telemetry);
+  }
+  memcpy(frame, data, sizeof(DataStruct));
+  computeTag(selfMac, frame, len, frame + len);
+  esp_now_send(BROADCAST_MAC, frame, len + FRAME_TAG_LEN);
+  rtcState.txFrames++;
+}
+
+void sendButtonPressed(uint8_t *mac) {
+  DataStruct sendingData = {};
+  sendingData.group_id = GROUP_ID;
+  sendingData.door_id = DOOR_ID;
+  memcpy((uint8_t *)sendingData.button_pressed_mac, mac, 6);
+  sendFrame(&sendingData);
+}
+
+HOT_PATH void sendWinner(uint8_t doorId, uint8_t *winner) {
+  DataStruct sendingData = {};
+  sendingData.group_id = GROUP_ID;
+  sendingData.door_id = doorId;
+  // TODO make it cleaner instead of this 6. Make it a struct instead?
+  memcpy((uint8_t *)sendingData.winner_mac, winner, 6);
+  sendFrame(&sendingData);
+}
+
+HOT_PATH TimingConfig *getTimingConfig(DataStruct *data, uint8_t len) {
+  if ((data->flags & FRAME_TIMING) &&
+      len == sizeof(DataStruct) + sizeof(TimingConfig) + FRAME_TAG_LEN) {
+    return (TimingConfig *)((uint8_t *)data + sizeof(DataStruct));
+  }
+  return NULL;
+}
+
+// Newer configs are kept until the next wake, see setup()
+void handleTimingConfig(TimingConfig *config) {
+  if (config->version > rtcState.timing.version &&
+      config->version > rtcState.pendingTiming.version &&
+      isTimingValid(config)) {
+    rtcState.pendingTiming = *config;
+  }
+}
+
+bool globalTimingAnnouncing = false;
+unsigned long globalTimingAnnounceStartedAt = 0;
+
+void startTimingAnnouncement() {
+  if (rtcState.timing.version == 0 || globalTimingAnnouncing) {
+    return;
+  }
+  globalTimingAnnouncing = true;
+  globalTimingAnnounceStartedAt = millis();
+}
+
+// Called by the coordinator and mains relay loops
+void runTimingAnnouncement() {
+  static unsigned long lastAnnouncement = 0;
+  if (!globalTimingAnnouncing) {
+    return;
+  }
+  if (millis() - globalTimingAnnounceStartedAt >
+      TIMING_ANNOUNCE_DURATION__ms) {
+    globalTimingAnnouncing = false;
+    return;
+  }
+  if (millis() - lastAnnouncement > TIMING_ANNOUNCE_INTERVAL__ms) {
+    DataStruct sendingData = {};
+    sendingData.group_id = GROUP_ID;
+    sendingData.flags = FRAME_TIMING;
+    sendFrame(&sendingData, (uint8_t *)&rtcState.timing,
+              sizeof(TimingConfig));
+    lastAnnouncement = millis();
+  }
+}
+
+void rebroadcast(uint8_t *data, uint8_t len) {
+  esp_now_send(BROADCAST_MAC, data, len);
+}
+
+// selfMac is read once in Radio_Init, before any callback can run
+HOT_PATH bool isMacAddressSelf(uint8_t *mac) {
+  return memcmp(mac, selfMac, 6) == 0;
+}
+
+// Returns NULL once the table is full. Nodes are never evicted, MAX_NODES is
+// sized for a whole house.
+HOT_PATH NodeTelemetry *findNode(uint8_t *mac) {
+  for (int i = 0; i < MAX_NODES; i++) {
+    NodeTelemetry *node = &globalNodes[i];
+    if (memcmp(node->telemetry.node_mac, mac, 6) == 0) {
+      return node;
+    }
+    if (isMacEmpty(node->telemetry.node_mac)) {
+      memcpy(node->telemetry.node_mac, mac, 6);
+      return node;
+    }
+  }
+  return NULL;
+}
+
+// Battery and class from the header of a frame the node sent us directly.
+// printHeardNodes() reports new ones, serial is too slow for the callback.
+HOT_PATH void recordNode(uint8_t *mac, DataStruct *data) {
+  NodeTelemetry *node = findNode(mac);
+  if (node == NULL) {
+    return;
+  }
+  NodeClass_t nodeClass = getNodeClass(data);
+  if (!node->heard || node->nodeClass != nodeClass) {
+    node->heard = true;
+    node->announced = false;
+    node->nodeClass = nodeClass;
+  }
+  if (node->telemetry.battery != data->battery) {
+    node->telemetry.battery = data->battery;
+    node->updated = true;
+  }
+}
+
+HOT_PATH void recordTelemetry(TelemetryStruct *telemetry) {
+  NodeTelemetry *node = findNode(telemetry->node_mac);
+  if (node != NULL) {
+    node->telemetry = *telemetry;
+    node->updated = true;
+  }
+  if (telemetry->timing_version < rtcState.timing.version) {
+    startTimingAnnouncement(); // It missed the last one
+  }
+}
+
+void printHeardNodes() {
+  for (int i = 0; i < MAX_NODES; i++) {
+    NodeTelemetry *node = &globalNodes[i];
+    if (node->heard && !node->announced) {
+      Serial.print("Heard ");
+      printMac(node->telemetry.node_mac);
+      Serial.printf(", a %s\n", NODE_CLASS_NAMES[node->nodeClass]);
+      node->announced = true;
+    }
+  }
+}
+
+void printNodesNeedingCharge() {
+  for (int i = 0; i < MAX_NODES; i++) {
+    NodeTelemetry *node = &globalNodes[i];
+    uint32_t mv = decodeBattery(node->telemetry.battery);
+    if (mv != 0 && mv < BATTERY_CHARGE_WARNING__mv) {
+      Serial.print("Needs charging: ");
+      printMac(node->telemetry.node_mac);
+      Serial.printf(" at %u mV\n", mv);
+    }
+  }
+}
+
+// CRC-16/CCITT-FALSE
+uint16_t crc16(const uint8_t *data, int len, uint16_t crc = 0xFFFF) {
+  for (int i = 0; i < len; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+/* Binary records share the serial port with the text logs. Each one is
+ * sync (2 bytes), type, payload length, payload, then a little endian CRC-16
+ * over type, length and payload. */
+void writeSerialRecord(uint8_t type, const uint8_t *payload, uint8_t len) {
+  uint8_t header[2] = {type, len};
+  uint16_t crc = crc16(payload, len, crc16(header, sizeof(header)));
+  Serial.write(SERIAL_RECORD_SYNC, sizeof(SERIAL_RECORD_SYNC));
+  Serial.write(header, sizeof(header));
+  Serial.write(payload, len);
+  Serial.write((uint8_t)(crc & 0xFF));
+  Serial.write((uint8_t)(crc >> 8));
+}
+
+void streamTelemetry() {
+  for (int i = 0; i < MAX_NODES; i++) {
+    NodeTelemetry *node = &globalNodes[i];
+    if (!node->updated) {
+      continue;
+    }
+    node->updated = false;
+    uint8_t payload[4 + sizeof(TelemetryStruct)];
+    uint32_t now = millis();
+    memcpy(payload, &now, 4);
+    memcpy(payload + 4, &node->telemetry, sizeof(TelemetryStruct));
+    writeSerialRecord(SERIAL_RECORD_TELEMETRY, payload, sizeof(payload));
+  }
+}
+
+/* Firmware updates over ESP-NOW. The host (tools/fwpush.py) uploads a delta
+ * image to the coordinator over serial, chunk by chunk, into spare flash. The
+ * coordinator then offers it, and awake buttons request chunks one at a time.
+ * Each chunk is a list of ops that rebuild the new image from the running one:
+ * copy from the running image, copy from earlier in the new image (LZ style),
+ * a run of one byte, or literal bytes. Buttons stage the output in spare flash
+ * a sector at a time, check its MD5, and only then have the bootloader copy it
+ * over the running image. Progress is kept in RTC memory so the update resumes
+ * on a later wake. */
+
+// flashRead needs 4-byte aligned offsets and sizes
+void readFlash(uint32_t address, uint8_t *data, int len) {
+  uint32_t words[FIRMWARE_READ_BLOCK / 4 + 2];
+  uint32_t start = address & ~3;
+  int total = (address - start + len + 3) & ~3;
+  ESP.flashRead(start, words, total);
+  memcpy(data, (uint8_t *)words + (address - start), len);
+}
+
+// Same placement as the core's Updater: the end of the free space before the
+// filesystem, so it never overlaps the running sketch
+uint32_t stagingAddress(uint32_t size) {
+  uint32_t end = (uintptr_t)&_FS_start - 0x40200000;
+  uint32_t rounded = (size + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+  uint32_t sketch =
+      (ESP.getSketchSize() + FLASH_SECTOR_SIZE - 1) & ~(FLASH_SECTOR_SIZE - 1);
+  if (rounded > end || end - rounded < sketch) {
+    return 0;
+  }
+  return end - rounded;
+}
+
+void sendFirmwareFrame(FirmwareStruct *firmware, const uint8_t *body,
+                       int bodyLen) {
+  uint8_t payload[MAX_FRAME_LEN];
+  memcpy(payload, firmware, sizeof(FirmwareStruct));
+  if (bodyLen > 0) {
+    memcpy(payload + sizeof(FirmwareStruct), body, bodyLen);
+  }
+  DataStruct sendingData = {};
+  sendingData.group_id = GROUP_ID;
+  sendingData.flags = FRAME_FIRMWARE;
+  sendFrame(&sendingData, payload, sizeof(FirmwareStruct) + bodyLen);
+}
+
+HOT_PATH FirmwareStruct *getFirmware(DataStruct *data, uint8_t len,
+                                     int *bodyLen) {
+  *bodyLen = len - sizeof(DataStruct) - sizeof(FirmwareStruct) - FRAME_TAG_LEN;
+  if (!(data->flags & FRAME_FIRMWARE) || *bodyLen < 0) {
+    return NULL;
+  }
+  return (FirmwareStruct *)((uint8_t *)data + sizeof(DataStruct));
+}
+
+/* Coordinator side */
+
+struct FirmwareCampaign {
+  bool active; // All chunks are stored and the image is being offered
+  uint16_t imageId;
+  FirmwareOffer offer;
+  uint32_t storeAddress;
+  uint16_t chunksStored;
+  unsigned long startedAt;
+  // Chunks requested by buttons and not yet sent
+  uint16_t requested[FIRMWARE_REQUEST_QUEUE];
+  uint8_t requestedCount;
+};
+FirmwareCampaign globalCampaign = {};
+
+void queueFirmwareRequest(uint16_t chunk) {
+  if (!globalCampaign.active || chunk >= globalCampaign.offer.chunk_count) {
+    return;
+  }
+  // Chunks are broadcast, so one send serves every button waiting for it
+  for (int i = 0; i < globalCampaign.requestedCount; i++) {
+    if (globalCampaign.requested[i] == chunk) {
+      return;
+    }
+  }
+  if (globalCampaign.requestedCount < FIRMWARE_REQUEST_QUEUE) {
+    globalCampaign.requested[globalCampaign.requestedCount++] = chunk;
+  }
+}
+
+void ackFirmwareUpload() {
+  uint16_t ack[2] = {globalCampaign.imageId, globalCampaign.chunksStored};
+  writeSerialRecord(SERIAL_RECORD_FIRMWARE_ACK, (uint8_t *)ack, sizeof(ack));
+}
+
+void handleFirmwareOfferRecord(const uint8_t *payload, uint8_t len) {
+  if (len != sizeof(FirmwareOffer)) {
+    return;
+  }
+  memset(&globalCampaign, 0, sizeof(globalCampaign));
+  memcpy(&globalCampaign.offer, payload, sizeof(FirmwareOffer));
+  const uint8_t *md5 = globalCampaign.offer.image_md5;
+  globalCampaign.imageId = md5[0] | md5[1] << 8;
+  globalCampaign.storeAddress = stagingAddress(
+      (uint32_t)globalCampaign.offer.chunk_count * FIRMWARE_CHUNK_SLOT);
+  if (globalCampaign.offer.chunk_count == 0) {
+    Serial.println("Firmware campaign cancelled");
+  } else if (globalCampaign.storeAddress == 0) {
+    Serial.println("ERROR, firmware delta doesn't fit in flash");
+    globalCampaign.offer.chunk_count = 0;
+  }
+  ackFirmwareUpload();
+}
+
+// Chunks arrive in order. Anything else is answered with the chunk we need.
+void handleFirmwareChunkRecord(const uint8_t *payload, uint8_t len) {
+  if (len < 2) { // Too short for the index, so the host resends from the ack
+    ackFirmwareUpload();
+    return;
+  }
+  uint16_t index = payload[0] | payload[1] << 8;
+  int bodyLen = len - 2;
+  if (globalCampaign.offer.chunk_count == 0 ||
+      index != globalCampaign.chunksStored || bodyLen <= 0 ||
+      bodyLen > FIRMWARE_CHUNK_MAX_BODY) {
+    ackFirmwareUpload();
+    return;
+  }
+  uint32_t slot[FIRMWARE_CHUNK_SLOT / 4];
+  memset(slot, 0xFF, sizeof(slot));
+  ((uint8_t *)slot)[0] = bodyLen & 0xFF;
+  ((uint8_t *)slot)[1] = bodyLen >> 8;
+  memcpy((uint8_t *)slot + 2, payload + 2, bodyLen);
+  uint32_t address = globalCampaign.storeAddress + index * FIRMWARE_CHUNK_SLOT;
+  if (address % FLASH_SECTOR_SIZE == 0) {
+    ESP.flashEraseSector(address / FLASH_SECTOR_SIZE);
+  }
+  ESP.flashWrite(address, slot, sizeof(slot));
+  globalCampaign.chunksStored++;
+  if (globalCampaign.chunksStored == globalCampaign.offer.chunk_count) {
+    Serial.printf("Offering firmware image %04x, %u bytes in %u chunks\n",
+                  globalCampaign.imageId, globalCampaign.offer.image_size,
+                  globalCampaign.offer.chunk_count);
+    globalCampaign.active = true;
+    globalCampaign.startedAt = millis();
+  }
+  ackFirmwareUpload();
+}
+
+// A profile, or a custom config if profile is PROFILE_CUSTOM. Version 0 means
+// one more than the current version.
+void handleTimingRecord(const uint8_t *payload, uint8_t len) {
+  if (len != sizeof(TimingConfig)) {
+    return;
+  }
+  TimingConfig config;
+  memcpy(&config, payload, sizeof(config));
+  if (config.profile < PROFILE_CUSTOM) {
+    uint16_t version = config.version;
+    config = TIMING_PROFILES[config.profile];
+    config.version = version;
+  }
+  if (config.version == 0) {
+    config.version = rtcState.timing.version + 1;
+  }
+  if (config.version > rtcState.timing.version && isTimingValid(&config)) {
+    applyTimingConfig(&config);
+    globalTimingAnnouncing = false; // Restart it with the new config
+    startTimingAnnouncement();
+    Serial.printf("Announcing timing config %u (%s)\n", config.version,
+                  TIMING_PROFILE_NAMES[config.profile]);
+  } else {
+    Serial.println("ERROR, rejected timing config");
+  }
+  // Echo what's in use, so the host can tell whether it was accepted
+  writeSerialRecord(SERIAL_RECORD_TIMING_ACK, (uint8_t *)&rtcState.timing,
+                    sizeof(TimingConfig));
+}
+
+// Reassembles framed records from the host, see writeSerialRecord()
+void pollSerialRecords() {
+  static uint8_t record[4 + 255 + 2];
+  static int received = 0;
+  while (Serial.available() > 0) {
+    uint8_t byte = Serial.read();
+    if (received < 2 && byte != SERIAL_RECORD_SYNC[received]) {
+      received = byte == SERIAL_RECORD_SYNC[0] ? 1 : 0;
+      continue;
+    }
+    record[received++] = byte;
+    if (received < 4 || received < 4 + record[3] + 2) {
+      continue;
+    }
+    received = 0;
+    uint8_t len = record[3];
+    uint16_t crc = record[4 + len] | record[4 + len + 1] << 8;
+    if (crc != crc16(record + 2, 2 + len)) {
+      continue;
+    }
+    if (record[2] == SERIAL_RECORD_FIRMWARE_OFFER) {
+      handleFirmwareOfferRecord(record + 4, len);
+    } else if (record[2] == SERIAL_RECORD_FIRMWARE_CHUNK) {
+      handleFirmwareChunkRecord(record + 4, len);
+    } else if (record[2] == SERIAL_RECORD_TIMING) {
+      handleTimingRecord(record + 4, len);
+    }
+  }
+}
+
+bool isAnyDashActive() {
+  for (uint8_t door = 0; door < NUM_DOORS; door++) {
+    if (globalDashes[door].hasDeclaredWinner) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void runFirmwareCampaign() {
+  static unsigned long lastOffer = 0;
+  if (!globalCampaign.active) {
+    return;
+  }
+  if (millis() - globalCampaign.startedAt > FIRMWARE_CAMPAIGN_DURATION__ms) {
+    Serial.println("Firmware campaign finished");
+    globalCampaign.active = false;
+    return;
+  }
+  if (isAnyDashActive()) { // Dashes get the airtime
+    return;
+  }
+  FirmwareStruct firmware = {};
+  firmware.image_id = globalCampaign.imageId;
+  if (globalCampaign.requestedCount > 0) {
+    firmware.chunk = globalCampaign.requested[0];
+    globalCampaign.requestedCount--;
+    memmove(globalCampaign.requested, globalCampaign.requested + 1,
+            globalCampaign.requestedCount * sizeof(uint16_t));
+    uint32_t slot[FIRMWARE_CHUNK_SLOT / 4];
+    ESP.flashRead(globalCampaign.storeAddress +
+                      firmware.chunk * FIRMWARE_CHUNK_SLOT,
+                  slot, sizeof(slot));
+    uint8_t *bytes = (uint8_t *)slot;
+    firmware.kind = FIRMWARE_CHUNK;
+    sendFirmwareFrame(&firmware, bytes + 2, bytes[0] | bytes[1] << 8);
+  } else if (millis() - lastOffer > FIRMWARE_OFFER_INTERVAL__ms) {
+    firmware.kind = FIRMWARE_OFFER;
+    firmware.chunk = globalCampaign.offer.chunk_count;
+    sendFirmwareFrame(&firmware, (uint8_t *)&globalCampaign.offer,
+                      sizeof(FirmwareOffer));
+    lastOffer = millis();
+  }
+}
+
+/* Button side */
+
+FirmwareOffer globalOffer = {};
+uint16_t globalOfferImageId = 0;
+unsigned long globalFirmwareStartedAt = 0;
+// The chunk we asked for, handed over by the receive callback
+uint8_t globalChunk[MAX_FRAME_LEN];
+int globalChunkLen = 0;
+bool globalChunkReady = false;
+// A frame heard from another node, to be sent on once by the loop
+uint8_t globalFirmwareRelay[MAX_FRAME_LEN];
+int globalFirmwareRelayLen = 0;
+bool globalFirmwareRelayReady = false;
+
+uint16_t globalOtaNextChunk = 0;
+// Output staging. globalOtaSector holds the output from sectorStart up to
+// written, everything before sectorStart is already in flash.
+uint32_t globalStagingAddress = 0;
+uint32_t globalOtaWritten = 0;
+uint32_t globalOtaSectorStart = 0;
+uint32_t globalOtaSector[FLASH_SECTOR_SIZE / 4];
+
+void flushFirmwareSector() {
+  uint32_t address = globalStagingAddress + globalOtaSectorStart;
+  ESP.flashEraseSector(address / FLASH_SECTOR_SIZE);
+  ESP.flashWrite(address, globalOtaSector, FLASH_SECTOR_SIZE);
+  globalOtaSectorStart += FLASH_SECTOR_SIZE;
+  memset(globalOtaSector, 0xFF, sizeof(globalOtaSector));
+  // The chunk being applied started at or before this sector, so resuming from
+  // it loses nothing. Saved now because pressing the button resets us.
+  rtcState.otaFlushed = globalOtaSectorStart;
+  rtcState.otaResumeChunk = globalOtaNextChunk;
+  saveRtcState();
+}
+
+// Bytes before `written` are already staged (we're re-applying a chunk after
+// resuming) and are skipped
+bool emitFirmwareBytes(uint32_t *position, const uint8_t *data, int len) {
+  for (int i = 0; i < len; i++, (*position)++) {
+    if (*position < globalOtaWritten) {
+      continue;
+    }
+    if (*position > globalOtaWritten ||
+        globalOtaWritten >= globalOffer.image_size) {
+      return false;
+    }
+    ((uint8_t *)globalOtaSector)[globalOtaWritten - globalOtaSectorStart] =
+        data[i];
+    globalOtaWritten++;
+    if (globalOtaWritten - globalOtaSectorStart == FLASH_SECTOR_SIZE) {
+      flushFirmwareSector();
+    }
+  }
+  return true;
+}
 
-  if (Serial) {
-    Serial.println("Going to sleep");
+// len is at most FIRMWARE_READ_BLOCK
+void readStagedFirmware(uint32_t offset, uint8_t *data, int len) {
+  if (offset < globalOtaSectorStart) {
+    int n = globalOtaSectorStart - offset < (uint32_t)len
+                ? globalOtaSectorStart - offset
+                : len;
+    readFlash(globalStagingAddress + offset, data, n);
+    offset += n;
+    data += n;
+    len -= n;
   }
-  ESP.deepSleepInstant(SLEEP_DURATION__us, WAKE_NO_RFCAL);
+  memcpy(data, (uint8_t *)globalOtaSector + (offset - globalOtaSectorStart),
+         len);
 }
 
-bool isWinnerMsg(DataStruct *data) {
-  for (int i = 0; i < 6; i++) {
-    if (data->winner_mac[i] != 0) {
-      return true;
+bool applyFirmwareChunk(const uint8_t *body, int len) {
+  if (len < 4) {
+    return false;
+  }
+  uint32_t position;
+  memcpy(&position, body, 4);
+  int i = 4;
+  uint8_t block[FIRMWARE_READ_BLOCK];
+  while (i < len) {
+    uint8_t op = body[i++];
+    if (op < FIRMWARE_OP_COPY_OLD) { // Literal of op + 1 bytes
+      int count = op + 1;
+      if (i + count > len || !emitFirmwareBytes(&position, body + i, count)) {
+        return false;
+      }
+      i += count;
+    } else if (op == FIRMWARE_OP_COPY_OLD || op == FIRMWARE_OP_COPY_NEW) {
+      if (i + 5 > len) {
+        return false;
+      }
+      uint32_t source = body[i] | body[i + 1] << 8 | body[i + 2] << 16;
+      int count = body[i + 3] | body[i + 4] << 8;
+      i += 5;
+      while (count > 0) {
+        int n = count < FIRMWARE_READ_BLOCK ? count : FIRMWARE_READ_BLOCK;
+        if (op == FIRMWARE_OP_COPY_OLD) {
+          readFlash(source, block, n); // The running sketch starts at 0
+        } else {
+          if (source >= position) {
+            return false;
+          }
+          if ((uint32_t)n > position - source) { // Overlapping copy
+            n = position - source;
+          }
+          readStagedFirmware(source, block, n);
+        }
+        if (!emitFirmwareBytes(&position, block, n)) {
+          return false;
+        }
+        source += n;
+        count -= n;
+      }
+    } else if (op == FIRMWARE_OP_FILL) {
+      if (i + 3 > len) {
+        return false;
+      }
+      int count = body[i] | body[i + 1] << 8;
+      memset(block, body[i + 2], sizeof(block));
+      i += 3;
+      while (count > 0) {
+        int n = count < FIRMWARE_READ_BLOCK ? count : FIRMWARE_READ_BLOCK;
+        if (!emitFirmwareBytes(&position, block, n)) {
+          return false;
+        }
+        count -= n;
+      }
+    } else {
+      return false;
     }
   }
-  return false;
+  return true;
 }
 
-void waitForSerial() {
-  while (!Serial) {
-    delay(1);
+bool isStagedFirmwareValid() {
+  if (globalOtaWritten != globalOffer.image_size) {
+    return false;
+  }
+  MD5Builder md5;
+  md5.begin();
+  uint8_t block[FIRMWARE_READ_BLOCK];
+  for (uint32_t offset = 0; offset < globalOffer.image_size;
+       offset += sizeof(block)) {
+    int n = globalOffer.image_size - offset < sizeof(block)
+                ? globalOffer.image_size - offset
+                : sizeof(block);
+    readFlash(globalStagingAddress + offset, block, n);
+    if (offset == 0 && block[0] != 0xE9) { // Image header magic
+      return false;
+    }
+    md5.add(block, n);
   }
+  md5.calculate();
+  uint8_t digest[16];
+  md5.getBytes(digest);
+  return memcmp(digest, globalOffer.image_md5, 16) == 0;
 }
 
-void callWatchdog() { yield(); }
+// Stop waking up for offers of this image, either because we've installed it or
+// because we can't
+void ignoreFirmware() {
+  rtcState.otaIgnoredImageId = globalOfferImageId;
+  rtcState.otaImageId = 0;
+  rtcState.otaFlushed = 0;
+  rtcState.otaResumeChunk = 0;
+  rtcState.otaBadChunks = 0;
+}
 
-void setupSerial() {
-  Serial.begin(115200);
-  waitForSerial();
-  Serial.println("Hello world!");
+// Undoes a chunk that failed part way through so it can be requested again.
+// Bytes it flushed are reloaded from the staged sector and overwritten.
+void rewindFirmwareChunk(uint32_t written, uint32_t sectorStart,
+                         uint16_t resumeChunk) {
+  if (globalOtaSectorStart != sectorStart) {
+    // Sector aligned, so it's read whole rather than through readFlash's
+    // small bounce buffer
+    ESP.flashRead(globalStagingAddress + sectorStart, globalOtaSector,
+                  FLASH_SECTOR_SIZE);
+    globalOtaSectorStart = sectorStart;
+    rtcState.otaFlushed = sectorStart;
+    rtcState.otaResumeChunk = resumeChunk;
+  }
+  globalOtaWritten = written;
+  rtcState.otaBadChunks++;
+  saveRtcState();
 }
 
-void transitionState(States_t newState) {
-  globalState = newState;
+// Hashing the sketch reads all of it from flash, so it's only done once per
+// boot rather than on every wake that resumes an update
+const uint8_t *sketchMd5() {
+  if (!rtcState.hasSketchMd5) {
+    String hex = ESP.getSketchMD5();
+    for (int i = 0; i < 16; i++) {
+      rtcState.sketchMd5[i] =
+          strtoul(hex.substring(i * 2, i * 2 + 2).c_str(), NULL, 16);
+    }
+    rtcState.hasSketchMd5 = true;
+  }
+  return rtcState.sketchMd5;
+}
 
-  switch (newState) {
-  case SLEEP_LISTEN:
-    Serial.println("Transitioned to SLEEP_LISTEN");
-    break;
-  case DOOR_DASH_WAITING:
-    Serial.println("Transitioned to DOOR_DASH_WAITING");
-    break;
-  case DOOR_DASH_WINNER:
-    Serial.println("Transitioned to DOOR_DASH_WINNER");
-    break;
-  case DOOR_DASH_LOSER:
-    Serial.println("Transitioned to DOOR_DASH_LOSER");
-    break;
-  case DOOR_DASH_COOL_DOWN_WINNER:
-    Serial.println("Transitioned to DOOR_DASH_COOL_DOWN_WINNER");
-    break;
-  case DOOR_DASH_COOL_DOWN_LOSER:
-    Serial.println("Transitioned to DOOR_DASH_COOL_DOWN_LOSER");
-    break;
-  case DOOR_DASH_COOL_DOWN_UNKNOWN:
-    Serial.println("Transitioned to DOOR_DASH_COOL_DOWN_UNKNOWN");
-    break;
-  default:
-    Serial.println("Transitioned to ERROR, unknown state");
-    break;
+void finishFirmwareUpdate() {
+  // The last sector is usually partial, pad it out with erased flash
+  if (globalOtaWritten > globalOtaSectorStart) {
+    flushFirmwareSector();
+  }
+  if (!isStagedFirmwareValid()) {
+    Serial.println("ERROR, staged firmware failed verification");
+    ignoreFirmware();
+    goToSleep();
   }
+  Serial.printf("Firmware image %04x verified, installing\n",
+                globalOfferImageId);
+  ignoreFirmware(); // RTC memory survives the restart
+  saveRtcState();
+  eboot_command ebcmd;
+  ebcmd.action = ACTION_COPY_RAW;
+  ebcmd.args[0] = globalStagingAddress;
+  ebcmd.args[1] = 0x00000;
+  ebcmd.args[2] = globalOffer.image_size;
+  eboot_command_write(&ebcmd);
+  ESP.restart();
 }
 
-void printMac(uint8_t *macaddr) {
-  for (byte n = 0; n < 6; n++) {
-    Serial.print(macaddr[n], HEX);
+// Carries on from the last flushed sector, see flushFirmwareSector()
+void resumeFirmwareStaging() {
+  globalOtaNextChunk = rtcState.otaResumeChunk;
+  globalOtaWritten = rtcState.otaFlushed;
+  globalOtaSectorStart = rtcState.otaFlushed;
+  memset(globalOtaSector, 0xFF, sizeof(globalOtaSector));
+}
+
+bool startFirmwareUpdate() {
+  // Only apply a delta to the image it was made against
+  const uint8_t *running = sketchMd5();
+  globalStagingAddress = stagingAddress(globalOffer.image_size);
+  if (memcmp(running, globalOffer.image_md5, 16) == 0) {
+    ignoreFirmware(); // Already running it
+    return false;
+  }
+  if (memcmp(running, globalOffer.base_md5, 16) != 0 ||
+      globalStagingAddress == 0) {
+    Serial.println("Firmware offer doesn't apply to this image");
+    ignoreFirmware();
+    return false;
   }
+  if (rtcState.otaImageId != globalOfferImageId) {
+    rtcState.otaImageId = globalOfferImageId;
+    rtcState.otaFlushed = 0;
+    rtcState.otaResumeChunk = 0;
+    rtcState.otaBadChunks = 0;
+  }
+  resumeFirmwareStaging();
+  Serial.printf("Updating to firmware %04x from chunk %u of %u\n",
+                globalOfferImageId, globalOtaNextChunk,
+                globalOffer.chunk_count);
+  return true;
 }
 
-void setMacAddress(uint8_t *mac) { WiFi.macAddress(mac); }
+void sendRelayedFirmwareFrame() {
+  if (globalFirmwareRelayReady) {
+    sendFirmwareFrame((FirmwareStruct *)globalFirmwareRelay,
+                      globalFirmwareRelay + sizeof(FirmwareStruct),
+                      globalFirmwareRelayLen - sizeof(FirmwareStruct));
+    globalFirmwareRelayReady = false;
+  }
+}
 
-void sendButtonPressed(uint8_t *mac) {
-  DataStruct sendingData = {};
-  memcpy((uint8_t *)sendingData.button_pressed_mac, mac, 6);
-  esp_now_send(BROADCAST_MAC, (uint8_t *)&sendingData,
-               sizeof(sendingData)); // NULL means send to all peers
+// Applies the chunk handed over by the receive callback. A bad one is undone
+// and requested again, until too many have been bad.
+void applyReceivedChunk() {
+  uint32_t written = globalOtaWritten;
+  uint32_t sectorStart = globalOtaSectorStart;
+  uint16_t resumeChunk = rtcState.otaResumeChunk;
+  if (applyFirmwareChunk(globalChunk, globalChunkLen)) {
+    globalOtaNextChunk++;
+  } else {
+    Serial.printf("ERROR, bad firmware chunk %u\n", globalOtaNextChunk);
+    rewindFirmwareChunk(written, sectorStart, resumeChunk);
+    if (rtcState.otaBadChunks >= FIRMWARE_MAX_BAD_CHUNKS) {
+      ignoreFirmware();
+      goToSleep();
+    }
+  }
+  globalChunkReady = false;
 }
 
-void sendWinner(uint8_t *winner) {
-  DataStruct sendingData = {};
-  // TODO make it cleaner instead of this 6. Make it a struct instead?
-  memcpy((uint8_t *)sendingData.winner_mac, winner, 6);
-  esp_now_send(BROADCAST_MAC, (uint8_t *)&sendingData,
-               sizeof(sendingData)); // NULL means send to all peers
+// Called by the button and mains relay loops while in FIRMWARE_UPDATE
+void runFirmwareUpdate() {
+  static bool started = false;
+  static unsigned long lastRequest = 0;
+  if (!started) {
+    if (!startFirmwareUpdate()) {
+      goToSleep();
+    }
+    started = true;
+  }
+  sendRelayedFirmwareFrame();
+  if (globalChunkReady) {
+    applyReceivedChunk();
+    lastRequest = 0; // Ask for the next one straight away
+    if (globalOtaNextChunk == globalOffer.chunk_count) {
+      finishFirmwareUpdate();
+    }
+  } else if (millis() - lastRequest > FIRMWARE_REQUEST_INTERVAL__ms) {
+    FirmwareStruct firmware = {};
+    firmware.kind = FIRMWARE_REQUEST;
+    firmware.image_id = globalOfferImageId;
+    firmware.chunk = globalOtaNextChunk;
+    sendFirmwareFrame(&firmware, NULL, 0);
+    lastRequest = millis();
+  }
+  // Bound the time a battery button spends on this per wake, it carries on
+  // from the last flushed sector next time it hears the offer
+  if (NODE_CLASS != NODE_MAINS_RELAY &&
+      millis() - globalFirmwareStartedAt > FIRMWARE_AWAKE_BUDGET__ms) {
+    Serial.printf("Pausing firmware update at chunk %u\n",
+                  globalOtaNextChunk);
+    goToSleep();
+  }
 }
 
-void rebroadcast(uint8_t *data, uint8_t len) {
-  esp_now_send(BROADCAST_MAC, data, len);
+// Sends on a firmware frame from another node once, re-signed by the loop
+void relayFirmwareFrame(FirmwareStruct *firmware, int bodyLen) {
+  static FirmwareStruct lastRelayed = {};
+  if (!isRelaying() || globalFirmwareRelayReady ||
+      memcmp(&lastRelayed, firmware, sizeof(FirmwareStruct)) == 0) {
+    return;
+  }
+  lastRelayed = *firmware;
+  globalFirmwareRelayLen = sizeof(FirmwareStruct) + bodyLen;
+  memcpy(globalFirmwareRelay, firmware, globalFirmwareRelayLen);
+  globalFirmwareRelayReady = true;
 }
 
-bool isMacAddressSelf(uint8_t *mac) {
-  uint8_t selfMacAddress[6] = {};
-  setMacAddress((uint8_t *)selfMacAddress);
-  for (int i = 0; i < 6; i++) {
-    if (mac[i] != selfMacAddress[i]) {
-      return false;
+void handleFirmwareFrame(FirmwareStruct *firmware, int bodyLen) {
+  uint8_t *body = (uint8_t *)firmware + sizeof(FirmwareStruct);
+  if (IS_COORDINATOR) {
+    if (firmware->kind == FIRMWARE_REQUEST &&
+        firmware->image_id == globalCampaign.imageId) {
+      queueFirmwareRequest(firmware->chunk);
     }
+    return;
+  }
+  if (firmware->kind == FIRMWARE_OFFER) {
+    if ((globalState == SLEEP_LISTEN || globalState == MAINS_RELAY) &&
+        bodyLen == sizeof(FirmwareOffer) &&
+        firmware->image_id != rtcState.otaIgnoredImageId &&
+        rtcState.powerMode == POWER_NORMAL) {
+      memcpy(&globalOffer, body, sizeof(FirmwareOffer));
+      globalOfferImageId = firmware->image_id;
+      globalFirmwareStartedAt = millis();
+      transitionState(FIRMWARE_UPDATE);
+    }
+  } else if (firmware->kind == FIRMWARE_CHUNK &&
+             globalState == FIRMWARE_UPDATE &&
+             firmware->image_id == globalOfferImageId &&
+             firmware->chunk == globalOtaNextChunk && !globalChunkReady) {
+    memcpy(globalChunk, body, bodyLen);
+    globalChunkLen = bodyLen;
+    globalChunkReady = true;
+  }
+  if (globalState == FIRMWARE_UPDATE) {
+    relayFirmwareFrame(firmware, bodyLen);
   }
-  return true;
 }
 
-void coordinatorCallBackFunction(uint8_t *senderMac, uint8_t *incomingData,
-                                 uint8_t len) {
+HOT_PATH void coordinatorCallBackFunction(uint8_t *senderMac,
+                                          uint8_t *incomingData, uint8_t len) {
+  if (!isOwnGroup(incomingData, len)) {
+    return;
+  }
   DataStruct *data = (DataStruct *)incomingData;
-  if (!globalHasDeclaredWinner) {
-    Serial.print("Declare winner: ");
-    printMac(data->button_pressed_mac);
-    Serial.println();
-    memcpy((uint8_t *)winnerMac, data->button_pressed_mac, 6);
+  if (data->door_id >= NUM_DOORS ||
+      !verifyFrame(senderMac, incomingData, len)) {
+    return;
+  }
+  recordNode(senderMac, data);
+  int bodyLen;
+  FirmwareStruct *firmware = getFirmware(data, len, &bodyLen);
+  if (firmware != NULL) {
+    handleFirmwareFrame(firmware, bodyLen);
+    return;
+  }
+  if (data->flags & FRAME_TIMING) { // A mains relay repeating ours
+    return;
+  }
+  TelemetryStruct *telemetry = getTelemetry(data, len);
+  if (telemetry != NULL) {
+    recordTelemetry(telemetry);
+  }
+  // Buttons and relays repeat our winner frames, they aren't presses
+  if (isWinnerMsg(data) || isMacEmpty(data->button_pressed_mac)) {
+    return;
+  }
+  DashContext *dash = &globalDashes[data->door_id];
+  if (!dash->hasDeclaredWinner) { // The loop prints it
+    memcpy((uint8_t *)dash->winnerMac, data->button_pressed_mac, 6);
 
-    globalDoorDashStartedAt = millis();
-    globalHasDeclaredWinner = true;
+    dash->startedAt = millis();
+    dash->announced = false;
+    dash->hasDeclaredWinner = true;
   }
 
-  if (globalHasDeclaredWinner) {
-    sendWinner((uint8_t *)winnerMac);
+  if (dash->hasDeclaredWinner) {
+    sendWinner(data->door_id, (uint8_t *)dash->winnerMac);
   }
 }
 
-void buttonCallBackFunction(uint8_t *senderMac, uint8_t *incomingData,
-                            uint8_t len) {
-
+HOT_PATH void buttonCallBackFunction(uint8_t *senderMac,
+                                     uint8_t *incomingData, uint8_t len) {
+  if (!isOwnGroup(incomingData, len)) {
+    return;
+  }
   DataStruct *data = (DataStruct *)incomingData;
+  int bodyLen;
+  FirmwareStruct *firmware = getFirmware(data, len, &bodyLen);
+  TimingConfig *timing = getTimingConfig(data, len);
+  // Firmware and timing frames are for every door
+  if ((firmware == NULL && timing == NULL && data->door_id != DOOR_ID) ||
+      !verifyFrame(senderMac, incomingData, len)) {
+    return;
+  }
+  if (firmware != NULL) {
+    handleFirmwareFrame(firmware, bodyLen);
+    return;
+  }
+  if (timing != NULL) {
+    handleTimingConfig(timing);
+    return;
+  }
+  TelemetryStruct *telemetry = getTelemetry(data, len);
+  if (telemetry != NULL && !isMacAddressSelf(telemetry->node_mac) &&
+      isRelaying()) {
+    globalRelayedTelemetry = *telemetry;
+    globalHasRelayedTelemetry = true;
+  }
   // Handle state changes, and rebroadcasting
   if (isWinnerMsg(data)) { // WINNER_MSG
-    if (globalState == SLEEP_LISTEN || globalState == DOOR_DASH_WAITING) {
+    if (globalState == SLEEP_LISTEN || globalState == DOOR_DASH_WAITING ||
+        globalState == FIRMWARE_UPDATE) {
+      if (globalState == DOOR_DASH_WAITING) {
+        rtcState.lastLatency__ms = millis() - globalDoorDashStartedAt;
+      }
       memcpy((uint8_t *)winnerMac, data->winner_mac, 6);
       if (isMacAddressSelf(data->winner_mac)) {
         transitionState(DOOR_DASH_WINNER);
@@ -198,7 +2000,8 @@ void buttonCallBackFunction(uint8_t *senderMac, uint8_t *incomingData,
       }
     }
   } else { // PRESSED_MSG
-    if (globalState == SLEEP_LISTEN) {
+    // A dash interrupts a firmware update, which resumes on a later wake
+    if (globalState == SLEEP_LISTEN || globalState == FIRMWARE_UPDATE) {
       memcpy((uint8_t *)BUTTON_PRESSED_MAC, data->button_pressed_mac, 6);
       transitionState(DOOR_DASH_WAITING);
     }
@@ -209,66 +2012,178 @@ void buttonCallBackFunction(uint8_t *senderMac, uint8_t *incomingData,
   }
 }
 
-void Radio_Init() {
-  if (esp_now_init() != 0) {
-    Serial.println("*** ESP_Now init failed");
-    while (true) {
-    };
+// Mains relay state for one door. A dash is relayed for flashDuration__ms,
+// then frames for the door are ignored for a cool down like a button's.
+// Otherwise two relays in range would re-arm each other from each other's
+// last winner frames, forever.
+struct RelayedDash {
+  unsigned long heardAt; // When the press or the winner was first heard, 0 if
+                         // idle
+  bool hasWinner;
+  uint8_t pressedMac[6];
+  uint8_t winnerMac[6];
+};
+RelayedDash globalRelayedDashes[RELAY_NUM_DOORS] = {};
+
+HOT_PATH bool isRelayedDashOver(RelayedDash *dash) {
+  return dash->heardAt != 0 &&
+         millis() - dash->heardAt > rtcState.timing.flashDuration__ms;
+}
+
+HOT_PATH void relayCallBackFunction(uint8_t *senderMac, uint8_t *incomingData,
+                                    uint8_t len) {
+  if (!isOwnGroup(incomingData, len)) {
+    return;
   }
-  // role set to COMBO so it can send and receive - not sure this is essential
-  esp_now_set_self_role(ESP_NOW_ROLE_COMBO);
+  DataStruct *data = (DataStruct *)incomingData;
+  if (data->door_id >= RELAY_NUM_DOORS ||
+      !verifyFrame(senderMac, incomingData, len)) {
+    return;
+  }
+  int bodyLen;
+  FirmwareStruct *firmware = getFirmware(data, len, &bodyLen);
+  if (firmware != NULL) {
+    handleFirmwareFrame(firmware, bodyLen);
+    relayFirmwareFrame(firmware, bodyLen);
+    return;
+  }
+  TimingConfig *timing = getTimingConfig(data, len);
+  if (timing != NULL) {
+    handleTimingConfig(timing); // Applied and repeated by the loop
+    return;
+  }
+  TelemetryStruct *telemetry = getTelemetry(data, len);
+  if (telemetry != NULL && !isMacAddressSelf(telemetry->node_mac)) {
+    globalRelayedTelemetry = *telemetry;
+    globalHasRelayedTelemetry = true;
+  }
+  if (telemetry != NULL &&
+      telemetry->timing_version < rtcState.timing.version) {
+    startTimingAnnouncement();
+  }
+  RelayedDash *dash = &globalRelayedDashes[data->door_id];
+  if (isRelayedDashOver(dash)) {
+    return;
+  }
+  if (isWinnerMsg(data)) {
+    if (!dash->hasWinner) {
+      memcpy(dash->winnerMac, data->winner_mac, 6);
+      dash->hasWinner = true;
+      dash->heardAt = millis();
+    }
+  } else if (dash->heardAt == 0) {
+    memcpy(dash->pressedMac, data->button_pressed_mac, 6);
+    dash->heardAt = millis();
+  }
+}
 
-  WiFi.mode(WIFI_STA); // Station mode for esp-now controller
+// Traffic generator only: the last pressed frame sent for each door
+struct TrafficDoor {
+  unsigned long sentAt__us;
+  bool waiting; // For a winner frame
+};
+TrafficDoor globalTrafficDoors[NUM_DOORS] = {};
+uint32_t globalTrafficLatencies__us[TRAFFIC_MAX_LATENCIES];
+uint8_t globalTrafficLatencyCount = 0;
+uint32_t globalTrafficReplies = 0;
+
+void trafficCallBackFunction(uint8_t *senderMac, uint8_t *incomingData,
+                             uint8_t len) {
+  if (!isOwnGroup(incomingData, len)) {
+    return;
+  }
+  DataStruct *data = (DataStruct *)incomingData;
+  if (data->door_id >= NUM_DOORS || !isWinnerMsg(data) ||
+      !verifyFrame(senderMac, incomingData, len)) {
+    return;
+  }
+  TrafficDoor *door = &globalTrafficDoors[data->door_id];
+  if (!door->waiting) {
+    return;
+  }
+  door->waiting = false;
+  globalTrafficReplies++;
+  if (globalTrafficLatencyCount < TRAFFIC_MAX_LATENCIES) {
+    globalTrafficLatencies__us[globalTrafficLatencyCount++] =
+        micros() - door->sentAt__us;
+  }
+}
+
+esp_now_recv_cb_t globalRecvCallback = NULL;
+
+HOT_PATH void timedCallBackFunction(uint8_t *senderMac, uint8_t *incomingData,
+                                    uint8_t len) {
+  // Other groups' frames are dropped straight away, and would make the stats
+  // look cheaper than our own frames are
+  if (!isOwnGroup(incomingData, len)) {
+    return;
+  }
+  uint32_t start = ESP.getCycleCount();
+  globalRecvCallback(senderMac, incomingData, len);
+  uint32_t cycles = ESP.getCycleCount() - start;
+  globalCallbackCycles += cycles;
+  globalCallbacks++;
+  if (cycles > globalMaxCallbackCycles) {
+    globalMaxCallbackCycles = cycles;
+  }
+}
+
+// Radio_Init's logging, kept in flash so the wake path in IRAM stays small
+void radioInitFailed() {
+  Serial.println("*** ESP_Now init failed");
+  while (true) {
+  };
+}
 
+void printRadioSetup(const char *role) {
   Serial.printf("This mac: %s, ", WiFi.macAddress().c_str());
   Serial.printf("target mac: %02x%02x%02x%02x%02x%02x", BROADCAST_MAC[0],
                 BROADCAST_MAC[1], BROADCAST_MAC[2], BROADCAST_MAC[3],
                 BROADCAST_MAC[4], BROADCAST_MAC[5]);
   Serial.printf(", channel: %i\n", WIFI_CHANNEL);
+  Serial.printf("Setup finished for %s\n", role);
+}
+
+HOT_PATH void Radio_Init() {
+  if (esp_now_init() != 0) {
+    radioInitFailed();
+  }
+  // role set to COMBO so it can send and receive - not sure this is essential
+  esp_now_set_self_role(ESP_NOW_ROLE_COMBO);
+
+  WiFi.mode(WIFI_STA); // Station mode for esp-now controller
 
   esp_now_add_peer(BROADCAST_MAC, ESP_NOW_ROLE_COMBO, WIFI_CHANNEL, NULL, 0);
 
+  WiFi.macAddress(selfMac);
+  markPowerEvent(EVENT_RADIO_ON);
+
   // TODO consider bringing back receiveCallBackFunction so that IS_COORDINATOR
   // is not checked twice
+  const char *role = "button";
   if (IS_COORDINATOR) {
-    Serial.println("Setup finished for coordinator");
-    esp_now_register_recv_cb(coordinatorCallBackFunction);
-  } else {
-    Serial.println("Setup finished for button");
-    esp_now_register_recv_cb(buttonCallBackFunction);
-  }
-}
-
-void ledWinner() {
-  // Flash LED fast
-  if ((millis() - globalDoorDashStartedAt) %
-          (DOOR_DASH_WINNER_FLASH_FREQUENCY__ms * 2) <
-      DOOR_DASH_WINNER_FLASH_FREQUENCY__ms) {
-    digitalWrite(BUTTON_LED, HIGH);
-  } else {
-    digitalWrite(BUTTON_LED, LOW);
-  }
-}
-
-void ledUnknown() {
-  // Slowly flash LED
-  if ((millis() - globalDoorDashStartedAt) %
-          (DOOR_DASH_WAITING_FLASH_FREQUENCY__ms * 2) <
-      DOOR_DASH_WAITING_FLASH_FREQUENCY__ms) {
-    digitalWrite(BUTTON_LED, HIGH);
+    role = "coordinator";
+    globalRecvCallback = coordinatorCallBackFunction;
+  } else if (globalState == MAINS_RELAY) {
+    role = "mains relay";
+    globalRecvCallback = relayCallBackFunction;
+  } else if (IS_TRAFFIC_GENERATOR) {
+    role = "traffic generator";
+    globalRecvCallback = trafficCallBackFunction;
   } else {
-    digitalWrite(BUTTON_LED, LOW);
+    globalRecvCallback = buttonCallBackFunction;
   }
+  esp_now_register_recv_cb(timedCallBackFunction);
+  globalRadioOnCycles = ESP.getCycleCount();
+  printRadioSetup(role);
 }
 
-void ledLoser() { digitalWrite(BUTTON_LED, HIGH); }
-
 void setupButton() {
   pinMode(BUTTON_INPUT, INPUT);
   bool btnPressed = digitalRead(BUTTON_INPUT);
   Radio_Init();
 
-  pinMode(BUTTON_LED, OUTPUT);
+  setupLed();
 
   if (!btnPressed) {
     // Wait for a message to have been received. Warning: while(true) loop won't
@@ -277,7 +2192,8 @@ void setupButton() {
     // for the setup to happen. Maybe there's some async setup that gets stuck
     // if we have a while(true) loop here. After this line, while (true) loops
     // are fine.
-    delay(50);
+    markPowerEvent(EVENT_LISTEN);
+    delay(listenTime__ms());
 
     if (globalState == SLEEP_LISTEN) {
       // Serial.println("Back to sleep");
@@ -286,6 +2202,14 @@ void setupButton() {
   }
 
   setupSerial();
+  if (!btnPressed) {
+    Serial.printf("Listen window of %lu ms: ", listenTime__ms());
+    printVerifyStats();
+    printCycleStats();
+  }
+  Serial.printf("Battery: %u mV, power mode %u\n", rtcState.battery__mv,
+                rtcState.powerMode);
+  bool shouldRelay = isRelaying();
   // At this point, one of two things has happened: the button was pressed, or
   // we received a message
 
@@ -295,73 +2219,90 @@ void setupButton() {
     globalDoorDashStartedAt = millis();
   }
 
-  keepCapacitorCharged(); // Prevent button from resetting mid-doordash
-
   unsigned long lastBroadcast = 0;
+  bool dashStarted = false;
   while (true) {
     callWatchdog();
+    topUpFrameCounters();
+    if (globalState == FIRMWARE_UPDATE) {
+      // Leave the capacitor alone so a button press still resets us into a
+      // dash
+      runFirmwareUpdate();
+      continue;
+    }
+    if (!dashStarted) {
+      keepCapacitorCharged(); // Prevent button from resetting mid-doordash
+      rtcState.dashes++;
+      dashStarted = true;
+    }
     if (globalState == DOOR_DASH_WAITING) {
-      ledUnknown();
+      ledShow(LED_WAITING);
       // Rebroadcast button pressed every 20ms
-      if (millis() - lastBroadcast > DOOR_DASH_REBROADCAST_INTERVAL__ms) {
+      if (millis() - lastBroadcast > rtcState.timing.rebroadcastInterval__ms) {
         if (btnPressed) {
           uint8_t selfMacAddress[6] = {};
           setMacAddress((uint8_t *)selfMacAddress);
           sendButtonPressed((uint8_t *)selfMacAddress);
-        } else {
+        } else if (shouldRelay) {
           sendButtonPressed((uint8_t *)BUTTON_PRESSED_MAC);
         }
         lastBroadcast = millis();
       }
-      // If more than FLASH_DURATION__ms has passed, cool down
+      // If more than flashDuration__ms has passed, cool down. Should
+      // theoretically never happen as long as the coordinator does its job.
       if (millis() - globalDoorDashStartedAt >
-          FLASH_DURATION__ms) { // Should theoretically never happen as long as
-                                // the coordinator does its job.
+          rtcState.timing.flashDuration__ms) {
         Serial.println("ERROR, never received a WINNER_MSG before cooldown");
         globalState = DOOR_DASH_COOL_DOWN_UNKNOWN;
+        markStatePowerEvent();
+        rtcState.missedWinners++;
       }
     } else if (globalState == DOOR_DASH_WINNER) {
-      // Broadcast repeatedly who the winner is
-      if (millis() - lastBroadcast > DOOR_DASH_REBROADCAST_INTERVAL__ms) {
-        sendWinner((uint8_t *)winnerMac);
+      // Broadcast repeatedly that we won. This is our own frame, not a relay,
+      // so leaves and low batteries send it too: other buttons rely on it.
+      if (millis() - lastBroadcast > rtcState.timing.rebroadcastInterval__ms) {
+        sendWinner(DOOR_ID, (uint8_t *)winnerMac);
         lastBroadcast = millis();
       }
-      ledWinner();
+      ledShow(LED_WINNER);
       // If more than 5 seconds have passed, go to cool down state
-      if (millis() - globalDoorDashStartedAt > FLASH_DURATION__ms) {
+      if (millis() - globalDoorDashStartedAt >
+          rtcState.timing.flashDuration__ms) {
         transitionState(DOOR_DASH_COOL_DOWN_WINNER);
       }
     } else if (globalState == DOOR_DASH_LOSER) {
       // Broadcast repeatedly who the winner is
-      if (millis() - lastBroadcast > DOOR_DASH_REBROADCAST_INTERVAL__ms) {
-        sendWinner((uint8_t *)winnerMac);
+      if (shouldRelay &&
+          millis() - lastBroadcast > rtcState.timing.rebroadcastInterval__ms) {
+        sendWinner(DOOR_ID, (uint8_t *)winnerMac);
         lastBroadcast = millis();
       }
-      ledLoser();
+      ledShow(LED_LOSER);
       // If more than 5 seconds have passed, go to cool down state
-      if (millis() - globalDoorDashStartedAt > FLASH_DURATION__ms) {
+      if (millis() - globalDoorDashStartedAt >
+          rtcState.timing.flashDuration__ms) {
         transitionState(DOOR_DASH_COOL_DOWN_LOSER);
       }
     } else if (globalState == DOOR_DASH_COOL_DOWN_WINNER) {
-      ledWinner();
+      ledShow(LED_WINNER);
       // Sleep after cool down period is over
       if (millis() - globalDoorDashStartedAt >
-          FLASH_DURATION__ms + COOL_DOWN__ms) {
+          rtcState.timing.flashDuration__ms + coolDown__ms()) {
         goToSleep();
       }
     } else if (globalState == DOOR_DASH_COOL_DOWN_LOSER) {
-      ledLoser();
+      ledShow(LED_LOSER);
       // Sleep after cool down period is over
       if (millis() - globalDoorDashStartedAt >
-          FLASH_DURATION__ms + COOL_DOWN__ms) {
+          rtcState.timing.flashDuration__ms + coolDown__ms()) {
         goToSleep();
       }
     } else { // DOOR_DASH_COOL_DOWN_UNKNOWN
-      ledUnknown();
+      ledShow(LED_UNKNOWN);
 
       // Sleep after cool down period is over
       if (millis() - globalDoorDashStartedAt >
-          FLASH_DURATION__ms + COOL_DOWN__ms) {
+          rtcState.timing.flashDuration__ms + coolDown__ms()) {
         goToSleep();
       }
     }
@@ -372,22 +2313,325 @@ void setupCoordinator() {
   setupSerial();
   Radio_Init();
 
+  unsigned long lastChargeReport = 0;
+  unsigned long lastTelemetryReport = 0;
+  startTimingAnnouncement(); // For buttons that were off when it changed
   while (true) {
     callWatchdog();
-    if (globalHasDeclaredWinner && millis() - globalDoorDashStartedAt >
-                                       DOOR_DASH_COORDINATION_DURATION__ms) {
-      Serial.println("Resetting after doordash");
-      globalDoorDashStartedAt = 0;
-      globalHasDeclaredWinner = false;
+    topUpFrameCounters();
+    pollSerialRecords();
+    runFirmwareCampaign();
+    if (!isAnyDashActive()) { // Dashes get the airtime
+      runTimingAnnouncement();
+    }
+    if (millis() - lastChargeReport > CHARGE_REPORT_INTERVAL__ms) {
+      printNodesNeedingCharge();
+      printCycleStats(); // Callbacks since the last report
+      globalCallbackCycles = 0;
+      globalMaxCallbackCycles = 0;
+      globalCallbacks = 0;
+      lastChargeReport = millis();
+    }
+    if (millis() - lastTelemetryReport > TELEMETRY_REPORT_INTERVAL__ms) {
+      streamTelemetry();
+      lastTelemetryReport = millis();
+    }
+    printHeardNodes();
+    for (uint8_t door = 0; door < NUM_DOORS; door++) {
+      DashContext *dash = &globalDashes[door];
+      if (dash->hasDeclaredWinner && !dash->announced) {
+        Serial.printf("Declare winner for door %d: ", door);
+        printMac(dash->winnerMac);
+        Serial.println();
+        dash->announced = true;
+      }
+      if (dash->hasDeclaredWinner &&
+          millis() - dash->startedAt >
+              rtcState.timing.coordinationDuration__ms) {
+        Serial.printf("Resetting after doordash for door %d\n", door);
+        dash->startedAt = 0;
+        dash->hasDeclaredWinner = false;
+      }
+    }
+  }
+}
+
+/* Mains relays never deep sleep. They repeat every door's press until the
+ * winner is heard, then repeat the winner, so battery buttons can use short
+ * listen windows and don't need to relay. The radio stays on: modem sleep
+ * only works while associated to an access point, which ESP-NOW nodes aren't.
+ * A press on a relay's own button resets it into setupButton(), and
+ * goToSleep() restarts it back into here. */
+void setupMainsRelay() {
+  setupSerial();
+  transitionState(MAINS_RELAY);
+  Radio_Init();
+
+  unsigned long lastBroadcast = 0;
+  startTimingAnnouncement();
+  while (true) {
+    callWatchdog();
+    topUpFrameCounters();
+    if (globalState == FIRMWARE_UPDATE) {
+      runFirmwareUpdate();
+    } else {
+      sendRelayedFirmwareFrame();
+    }
+    if (rtcState.pendingTiming.version > rtcState.timing.version) {
+      applyTimingConfig(&rtcState.pendingTiming);
+      globalTimingAnnouncing = false;
+      startTimingAnnouncement();
+    }
+    runTimingAnnouncement();
+    if (millis() - lastBroadcast <= rtcState.timing.rebroadcastInterval__ms) {
+      continue;
+    }
+    lastBroadcast = millis();
+    for (uint8_t door = 0; door < RELAY_NUM_DOORS; door++) {
+      RelayedDash *dash = &globalRelayedDashes[door];
+      if (dash->heardAt == 0) {
+        continue;
+      }
+      if (millis() - dash->heardAt >
+          rtcState.timing.flashDuration__ms + coolDown__ms()) {
+        memset(dash, 0, sizeof(RelayedDash));
+      } else if (isRelayedDashOver(dash)) {
+        continue; // Cooling down
+      } else if (dash->hasWinner) {
+        sendWinner(door, dash->winnerMac);
+      } else {
+        DataStruct sendingData = {};
+        sendingData.group_id = GROUP_ID;
+        sendingData.door_id = door;
+        memcpy(sendingData.button_pressed_mac, dash->pressedMac, 6);
+        sendFrame(&sendingData);
+      }
+    }
+  }
+}
+
+void printTrafficReport(uint32_t sent, uint32_t unanswered) {
+  uint32_t *latencies = globalTrafficLatencies__us;
+  uint8_t count = globalTrafficLatencyCount;
+  for (uint8_t i = 1; i < count; i++) { // Insertion sort, there are few
+    uint32_t latency = latencies[i];
+    uint8_t j = i;
+    for (; j > 0 && latencies[j - 1] > latency; j--) {
+      latencies[j] = latencies[j - 1];
+    }
+    latencies[j] = latency;
+  }
+  Serial.printf("Traffic: sent %u, replies %u, unanswered %u", sent,
+                globalTrafficReplies, unanswered);
+  if (count > 0) {
+    Serial.printf(", latency p50 %u p90 %u p99 %u max %u us",
+                  latencies[count / 2], latencies[count * 9 / 10],
+                  latencies[count * 99 / 100], latencies[count - 1]);
+  }
+  Serial.println();
+  globalTrafficLatencyCount = 0;
+  globalTrafficReplies = 0;
+}
+
+void setupTrafficGenerator() {
+  setupSerial();
+  Radio_Init();
+
+  const unsigned long interval__us = 1e6 / TRAFFIC_FRAMES_PER_SECOND;
+  unsigned long lastSend__us = micros();
+  unsigned long lastReport = millis();
+  uint32_t sent = 0;
+  uint32_t unanswered = 0;
+  while (true) {
+    callWatchdog();
+    topUpFrameCounters();
+    if (micros() - lastSend__us >= interval__us) {
+      lastSend__us += interval__us;
+      uint8_t doorId = sent % NUM_DOORS;
+      TrafficDoor *door = &globalTrafficDoors[doorId];
+      if (door->waiting) {
+        unanswered++;
+      }
+      DataStruct sendingData = {};
+      sendingData.group_id = GROUP_ID;
+      sendingData.door_id = doorId;
+      // Locally administered MACs, so they can't clash with a real button
+      uint8_t pressedMac[6] = {0x02, 0xD0, 0x0D, 0x00, 0x00,
+                               (uint8_t)(sent % TRAFFIC_SENDERS)};
+      memcpy(sendingData.button_pressed_mac, pressedMac, 6);
+      door->sentAt__us = micros();
+      door->waiting = true;
+      sendFrame(&sendingData);
+      sent++;
+    }
+    if (millis() - lastReport > TRAFFIC_REPORT_INTERVAL__ms) {
+      printTrafficReport(sent, unanswered);
+      sent = 0;
+      unanswered = 0;
+      lastReport = millis();
+    }
+  }
+}
+
+/* Sniffer mode. In promiscuous mode the SDK hands over the radio's metadata
+ * and the first 112 bytes of every management frame. ESP-NOW frames are
+ * vendor specific action frames, so that covers the 802.11 header, the
+ * ESP-NOW header and a DataStruct with telemetry, but not a whole firmware
+ * chunk. The layout is from the ESP8266 SDK's sniffer documentation. */
+struct SnifferRxControl {
+  signed rssi : 8;
+  unsigned rate : 4;
+  unsigned is_group : 1;
+  unsigned : 1;
+  unsigned sig_mode : 2; // 0 for 802.11b/g, else 802.11n
+  unsigned legacy_length : 12;
+  unsigned damatch0 : 1;
+  unsigned damatch1 : 1;
+  unsigned bssidmatch0 : 1;
+  unsigned bssidmatch1 : 1;
+  unsigned mcs : 7;
+  unsigned cwb : 1;
+  unsigned ht_length : 16;
+  unsigned smoothing : 1;
+  unsigned not_sounding : 1;
+  unsigned : 1;
+  unsigned aggregation : 1;
+  unsigned stbc : 2;
+  unsigned fec_coding : 1;
+  unsigned sgi : 1;
+  unsigned rxend_state : 8;
+  unsigned ampdu_cnt : 8;
+  unsigned channel : 4;
+  unsigned : 12;
+};
+
+struct SnifferManagementBuffer {
+  SnifferRxControl rx_ctrl;
+  uint8_t buf[112];
+  uint16_t cnt;
+  uint16_t len;
+};
+
+// Offsets into the 802.11 frame
+const uint8_t SNIFFER_SENDER_OFFSET = 10;
+const uint8_t SNIFFER_SEQUENCE_OFFSET = 22;
+const uint8_t SNIFFER_CATEGORY_OFFSET = 24;
+const uint8_t SNIFFER_ELEMENT_OFFSET = 32;
+const uint8_t SNIFFER_BODY_OFFSET = 39;
+const uint8_t SNIFFER_MAX_BODY = 112 - SNIFFER_BODY_OFFSET;
+const uint8_t ESPRESSIF_OUI[3] = {0x18, 0xFE, 0x34};
+
+// SERIAL_RECORD_SNIFFED payload, cut short after the captured part of body
+struct __attribute__((packed)) SniffedFrame {
+  uint32_t at__us;
+  int8_t rssi;
+  uint8_t rate;      // The SDK's rate code, or 0x80 | MCS for 802.11n
+  uint8_t channel;
+  uint16_t length;   // Of the whole 802.11 frame as sent
+  uint8_t sender_mac[6];
+  uint16_t sequence; // 802.11 sequence control
+  uint8_t body_len;  // ESP-NOW payload length, can be more than was captured
+  uint8_t body[SNIFFER_MAX_BODY];
+};
+
+// Filled by the callback, drained by setupSniffer()'s loop
+SniffedFrame globalSniffed[SNIFFER_QUEUE_SIZE];
+volatile uint8_t globalSniffedHead = 0;
+volatile uint8_t globalSniffedTail = 0;
+volatile uint32_t globalSniffedFrames = 0;
+volatile uint32_t globalSniffedDropped = 0;
+
+void snifferCallBackFunction(uint8_t *buf, uint16_t len) {
+  if (len != sizeof(SnifferManagementBuffer)) {
+    return; // Data and control frames, or a management frame's trailer
+  }
+  SnifferManagementBuffer *packet = (SnifferManagementBuffer *)buf;
+  const uint8_t *frame = packet->buf;
+  const uint8_t *element = frame + SNIFFER_ELEMENT_OFFSET;
+  if (frame[0] != 0xD0 || frame[SNIFFER_CATEGORY_OFFSET] != 127 ||
+      memcmp(frame + SNIFFER_CATEGORY_OFFSET + 1, ESPRESSIF_OUI, 3) != 0 ||
+      element[0] != 0xDD || memcmp(element + 2, ESPRESSIF_OUI, 3) != 0 ||
+      element[5] != 4) {
+    return; // Not ESP-NOW
+  }
+  globalSniffedFrames++;
+  uint8_t next = (globalSniffedHead + 1) % SNIFFER_QUEUE_SIZE;
+  if (next == globalSniffedTail) {
+    globalSniffedDropped++;
+    return;
+  }
+  SniffedFrame *sniffed = &globalSniffed[globalSniffedHead];
+  SnifferRxControl *rx = &packet->rx_ctrl;
+  sniffed->at__us = micros();
+  sniffed->rssi = rx->rssi;
+  sniffed->rate = rx->sig_mode ? 0x80 | rx->mcs : rx->rate;
+  sniffed->channel = rx->channel;
+  sniffed->length = rx->sig_mode ? rx->ht_length : rx->legacy_length;
+  memcpy(sniffed->sender_mac, frame + SNIFFER_SENDER_OFFSET, 6);
+  memcpy(&sniffed->sequence, frame + SNIFFER_SEQUENCE_OFFSET, 2);
+  sniffed->body_len = element[1] - 5; // Less the OUI, type and version
+  memcpy(sniffed->body, frame + SNIFFER_BODY_OFFSET, SNIFFER_MAX_BODY);
+  globalSniffedHead = next;
+}
+
+void setupSniffer() {
+  Serial.begin(SNIFFER_BAUD);
+  waitForSerial();
+  Serial.printf("Sniffing ESP-NOW on channel %i\n", WIFI_CHANNEL);
+  wifi_set_opmode(STATION_MODE);
+  wifi_promiscuous_enable(0);
+  wifi_set_promiscuous_rx_cb(snifferCallBackFunction);
+  wifi_set_channel(WIFI_CHANNEL);
+  wifi_promiscuous_enable(1);
+
+  unsigned long lastStats = 0;
+  while (true) {
+    callWatchdog();
+    while (globalSniffedTail != globalSniffedHead) {
+      SniffedFrame *sniffed = &globalSniffed[globalSniffedTail];
+      uint8_t captured = sniffed->body_len;
+      if (captured > SNIFFER_MAX_BODY) {
+        captured = SNIFFER_MAX_BODY;
+      }
+      writeSerialRecord(SERIAL_RECORD_SNIFFED, (uint8_t *)sniffed,
+                        sizeof(SniffedFrame) - SNIFFER_MAX_BODY + captured);
+      globalSniffedTail = (globalSniffedTail + 1) % SNIFFER_QUEUE_SIZE;
+    }
+    if (millis() - lastStats > SNIFFER_STATS_INTERVAL__ms) {
+      Serial.printf("Sniffed %u frames, dropped %u\n", globalSniffedFrames,
+                    globalSniffedDropped);
+      lastStats = millis();
     }
   }
 }
 
 void loop() { Serial.println("ERROR, this should never run"); }
 
-void setup() {
+HOT_PATH void setup() {
+  globalSetupStartCycles = ESP.getCycleCount();
+  if (IS_SNIFFER) {
+    setupSniffer();
+  }
+  if (POWER_MARKERS) {
+    pinMode(MARKER_PIN, OUTPUT);
+    markPowerEvent(EVENT_WAKE);
+  }
+  loadRtcState();
+  if (rtcState.pendingTiming.version > rtcState.timing.version) {
+    applyTimingConfig(&rtcState.pendingTiming);
+  }
+  if (!IS_COORDINATOR &&
+      rtcState.wakeCount++ % BATTERY_SAMPLE_INTERVAL_WAKES == 0 &&
+      NODE_CLASS != NODE_MAINS_RELAY) {
+    sampleBattery();
+  }
+  topUpFrameCounters(); // After a cold boot, before any callback can send
   if (IS_COORDINATOR) {
     setupCoordinator();
+  } else if (IS_TRAFFIC_GENERATOR) {
+    setupTrafficGenerator();
+  } else if (NODE_CLASS == NODE_MAINS_RELAY && !digitalRead(BUTTON_INPUT)) {
+    setupMainsRelay();
   } else {
     setupButton();
   }
@@ -0,0 +1,421 @@
+#!/usr/bin/env python3
+"""Pushes a firmware image to the buttons through the coordinator.
+
+    python3 tools/fwpush.py new.bin --base old.bin /dev/cu.usbserial-21210
+
+The image is sent as a delta against the firmware the buttons are running
+now (--base, the .bin they were flashed with). The coordinator stores the
+chunks, then offers the image over ESP-NOW for an hour. Buttons that hear the
+offer and are running the base image fetch the chunks, stage the new image in
+spare flash, check its MD5 and switch to it.
+
+--simulate runs the same push against a stand-in coordinator and button in
+this process, including the button pausing and resuming across sleeps, and
+checks the rebuilt image matches. --report N estimates the time and battery
+cost of updating N buttons. Neither needs hardware.
+"""
+
+import argparse
+import hashlib
+import random
+import struct
+import sys
+import time
+
+import serial_records
+
+# Mirrors the FIRMWARE_* constants and FirmwareOffer in src/main.cpp
+OP_COPY_OLD = 0x80  # Below this: literal of op + 1 bytes
+OP_COPY_NEW = 0x81
+OP_FILL = 0x82
+MAX_LITERAL = 0x80
+MAX_COPY = 0xFFFF
+MAX_SOURCE = 0xFFFFFF
+CHUNK_MAX_BODY = 220  # FIRMWARE_CHUNK_MAX_BODY
+FLASH_SECTOR_SIZE = 4096
+OFFER_FORMAT = "<IH16s16s"
+ACK_FORMAT = "<HH"
+
+MATCH_BLOCK = 8  # Shortest copy worth an op
+MIN_FILL = 6
+
+# Model used by --report. Airtime is for a 1Mbps broadcast plus MAC overhead.
+SLEEP_DURATION_S = 2.0  # SLEEP_DURATION__us
+AWAKE_BUDGET_S = 10.0  # FIRMWARE_AWAKE_BUDGET__ms
+CAMPAIGN_DURATION_S = 3600.0  # FIRMWARE_CAMPAIGN_DURATION__ms
+FRAME_OVERHEAD_BYTES = 60
+AIRTIME_S_PER_BYTE = 8e-6
+EXCHANGE_OVERHEAD_S = 0.004  # Loop latency and signing on both ends
+SECTOR_WRITE_S = 0.05
+MD5_S_PER_BYTE = 1.5e-6
+AWAKE_CURRENT_MA = 90.0  # From the README's power capture
+BATTERY_MAH = 3200.0
+
+
+def image_id(md5):
+    return md5[0] | md5[1] << 8
+
+
+def literal_ops(data):
+    ops = []
+    for i in range(0, len(data), MAX_LITERAL):
+        part = data[i : i + MAX_LITERAL]
+        ops.append((bytes([len(part) - 1]) + part, len(part)))
+    return ops
+
+
+def index_blocks(data, index, start, end):
+    for i in range(start, end):
+        index.setdefault(data[i : i + MATCH_BLOCK], i)
+
+
+def match_length(a, a_start, b, b_start, limit):
+    n = 0
+    while n < limit and a[a_start + n] == b[b_start + n]:
+        n += 1
+    return n
+
+
+def encode_delta(base, image):
+    """Returns a list of (op bytes, output length).
+
+    Greedy: at each position take the longest of a copy from the base image,
+    a copy from earlier in the new image, or a run of one byte. Otherwise the
+    byte goes into a literal.
+    """
+    old_index = {}
+    index_blocks(base, old_index, 0,
+                 min(len(base), MAX_SOURCE) - MATCH_BLOCK + 1)
+    new_index = {}
+    indexed = 0
+    ops = []
+    literal = bytearray()
+    position = 0
+    while position < len(image):
+        limit = min(MAX_COPY, len(image) - position)
+        best = (0, None, 0)
+        run = match_length(image, position, image, position + 1, limit - 1) + 1
+        if run >= MIN_FILL:
+            best = (run, OP_FILL, image[position])
+        key = image[position : position + MATCH_BLOCK]
+        source = old_index.get(key)
+        if source is not None:
+            n = match_length(image, position, base, source,
+                             min(limit, len(base) - source))
+            if n > best[0]:
+                best = (n, OP_COPY_OLD, source)
+        index_blocks(image, new_index, indexed,
+                     min(position, MAX_SOURCE) - MATCH_BLOCK + 1)
+        indexed = max(indexed, min(position, MAX_SOURCE) - MATCH_BLOCK + 1)
+        source = new_index.get(key)
+        if source is not None:
+            n = match_length(image, position, image, source, limit)
+            if n > best[0]:
+                best = (n, OP_COPY_NEW, source)
+        length, op, arg = best
+        if length < MATCH_BLOCK and op != OP_FILL:
+            literal.append(image[position])
+            position += 1
+            continue
+        ops += literal_ops(bytes(literal))
+        literal = bytearray()
+        if op == OP_FILL:
+            ops.append((struct.pack("<BHB", op, length, arg), length))
+        else:
+            ops.append((struct.pack("<BI", op, arg)[:4] +
+                        struct.pack("<H", length), length))
+        position += length
+    ops += literal_ops(bytes(literal))
+    return ops
+
+
+def pack_chunks(ops):
+    """Packs ops into chunk bodies, each starting with its output offset.
+
+    Ops are never split, so a button can apply each chunk on its own.
+    """
+    chunks = []
+    body = None
+    position = 0
+    for op, length in ops:
+        if body is None or len(body) + len(op) > CHUNK_MAX_BODY:
+            if body is not None:
+                chunks.append(bytes(body))
+            body = bytearray(struct.pack("<I", position))
+        body += op
+        position += length
+    if body is not None:
+        chunks.append(bytes(body))
+    return chunks
+
+
+class Button:
+    """applyFirmwareChunk() and friends from src/main.cpp.
+
+    Output is flushed a sector at a time, and pausing loses everything after
+    the last flush, as a button going to sleep would.
+    """
+
+    def __init__(self, base, offer):
+        self.base = base
+        self.image_size = offer[0]
+        self.image_md5 = offer[2]
+        self.staged = bytearray()
+        self.flushed = 0
+        self.resume_chunk = 0
+        self.next_chunk = 0
+        self.written = 0
+
+    def pause(self):
+        del self.staged[self.flushed :]
+        self.written = self.flushed
+        self.next_chunk = self.resume_chunk
+
+    def emit(self, position, data):
+        for byte in data:
+            if position >= self.written:
+                if position > self.written or self.written >= self.image_size:
+                    raise ValueError("chunk out of order")
+                self.staged.append(byte)
+                self.written += 1
+                if self.written % FLASH_SECTOR_SIZE == 0:
+                    self.flushed = self.written
+                    self.resume_chunk = self.next_chunk
+            position += 1
+        return position
+
+    def apply(self, body):
+        (position,) = struct.unpack_from("<I", body)
+        i = 4
+        while i < len(body):
+            op = body[i]
+            i += 1
+            if op < OP_COPY_OLD:
+                position = self.emit(position, body[i : i + op + 1])
+                i += op + 1
+            elif op in (OP_COPY_OLD, OP_COPY_NEW):
+                source = body[i] | body[i + 1] << 8 | body[i + 2] << 16
+                (count,) = struct.unpack_from("<H", body, i + 3)
+                i += 5
+                for offset in range(source, source + count):
+                    if op == OP_COPY_OLD:
+                        byte = self.base[offset]
+                    else:
+                        byte = self.staged[offset]
+                    position = self.emit(position, bytes([byte]))
+            elif op == OP_FILL:
+                count, byte = struct.unpack_from("<HB", body, i)
+                i += 3
+                position = self.emit(position, bytes([byte]) * count)
+            else:
+                raise ValueError("bad op %02x" % op)
+        self.next_chunk += 1
+
+    def is_valid(self):
+        return (
+            len(self.staged) == self.image_size
+            and hashlib.md5(self.staged).digest() == self.image_md5
+        )
+
+
+class SimulatedCoordinator:
+    """Stands in for the coordinator's serial port.
+
+    Handles offer and chunk records like handleFirmwareOfferRecord() and
+    handleFirmwareChunkRecord(), and answers with acks.
+    """
+
+    def __init__(self, drop_rate=0.0):
+        self.parser = serial_records.Parser()
+        self.pending = b""
+        self.offer = None
+        self.chunks = []
+        self.drop_rate = drop_rate
+
+    def write(self, data):
+        for item in self.parser.feed(data):
+            if item[0] != "record":
+                continue
+            if random.random() < self.drop_rate:
+                continue  # Lost on the wire, the host retries
+            _, record_type, payload = item
+            if record_type == serial_records.RECORD_FIRMWARE_OFFER:
+                self.offer = struct.unpack(OFFER_FORMAT, payload)
+                self.chunks = []
+            elif record_type == serial_records.RECORD_FIRMWARE_CHUNK:
+                (index,) = struct.unpack_from("<H", payload)
+                if self.offer is not None and index == len(self.chunks):
+                    self.chunks.append(payload[2:])
+            self.ack()
+
+    def ack(self):
+        if self.offer is None:
+            return
+        payload = struct.pack(ACK_FORMAT, image_id(self.offer[2]),
+                              len(self.chunks))
+        self.pending += serial_records.encode(
+            serial_records.RECORD_FIRMWARE_ACK, payload)
+
+    def read(self, size):
+        data, self.pending = self.pending[:size], self.pending[size:]
+        return data
+
+    def flush(self):
+        pass
+
+
+def wait_for_ack(port, parser, expected_id, timeout):
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+        data = port.read(256)
+        for item in parser.feed(data):
+            if item[0] == "text":
+                sys.stderr.write(item[1].decode("utf-8", "replace"))
+                continue
+            _, record_type, payload = item
+            if record_type != serial_records.RECORD_FIRMWARE_ACK:
+                continue
+            ack_id, stored = struct.unpack(ACK_FORMAT, payload)
+            if ack_id == expected_id:
+                return stored
+        if not data and isinstance(port, SimulatedCoordinator):
+            return None
+    return None
+
+
+def push(port, offer, chunks, timeout=1.0, retries=20):
+    """Sends the offer and every chunk, resending whatever isn't acked."""
+    expected_id = image_id(offer[2])
+    parser = serial_records.Parser()
+    offer_record = serial_records.encode(
+        serial_records.RECORD_FIRMWARE_OFFER,
+        struct.pack(OFFER_FORMAT, *offer))
+    for _ in range(retries):
+        port.write(offer_record)
+        port.flush()
+        if wait_for_ack(port, parser, expected_id, timeout) == 0:
+            break
+    else:
+        raise RuntimeError("coordinator didn't accept the offer")
+    stored = 0
+    failures = 0
+    while stored < len(chunks):
+        port.write(serial_records.encode(
+            serial_records.RECORD_FIRMWARE_CHUNK,
+            struct.pack("<H", stored) + chunks[stored]))
+        port.flush()
+        acked = wait_for_ack(port, parser, expected_id, timeout)
+        if acked is None or acked <= stored:
+            failures += 1
+            if failures > retries:
+                raise RuntimeError("coordinator stopped acking at chunk %d"
+                                   % stored)
+            continue
+        failures = 0
+        stored = acked
+        print("\rStored %d/%d chunks" % (stored, len(chunks)), end="",
+              file=sys.stderr)
+    print(file=sys.stderr)
+
+
+def simulate(base, image, offer, chunks, seed):
+    random.seed(seed)
+    coordinator = SimulatedCoordinator(drop_rate=0.05)
+    push(coordinator, offer, chunks)
+    button = Button(base, coordinator.offer)
+    wakes = 1
+    while button.next_chunk < len(coordinator.chunks):
+        if random.random() < 0.01:  # Button ran out of awake budget or dashed
+            button.pause()
+            wakes += 1
+            continue
+        button.apply(coordinator.chunks[button.next_chunk])
+    if not button.is_valid() or bytes(button.staged) != image:
+        raise RuntimeError("simulated button rebuilt a different image")
+    print("Simulated update OK: %d chunks applied over %d wakes"
+          % (len(chunks), wakes))
+
+
+def report(image, chunks, nodes, hops):
+    """Prints a rough estimate of the time and battery an update costs."""
+    # Each chunk is a request and a reply, repeated by each relaying hop
+    frame_bytes = sum(len(c) for c in chunks) + len(chunks) * (
+        2 * (21 + 5 + 4 + FRAME_OVERHEAD_BYTES))
+    airtime_s = frame_bytes * AIRTIME_S_PER_BYTE * hops
+    node_active_s = (
+        airtime_s
+        + len(chunks) * EXCHANGE_OVERHEAD_S * hops
+        + len(image) / FLASH_SECTOR_SIZE * SECTOR_WRITE_S
+        + len(image) * MD5_S_PER_BYTE * 2  # Running image, then staged one
+    )
+    wakes = int(node_active_s // AWAKE_BUDGET_S) + 1
+    # A paused button waits one sleep to hear the offer again
+    node_elapsed_s = node_active_s + wakes * SLEEP_DURATION_S
+    # Buttons update in parallel but share the channel
+    fleet_s = max(node_elapsed_s, airtime_s * nodes)
+    charge_mah = node_active_s * AWAKE_CURRENT_MA / 3600
+    print("Image: %d bytes, delta: %d bytes in %d chunks (%.1f%%)"
+          % (len(image), sum(len(c) for c in chunks), len(chunks),
+             100.0 * sum(len(c) for c in chunks) / max(len(image), 1)))
+    print("Per button: %.1f s awake over %d wakes, %.2f mAh (%.3f%% of a "
+          "%d mAh battery)" % (node_active_s, wakes, charge_mah,
+                               100 * charge_mah / BATTERY_MAH, BATTERY_MAH))
+    print("%d buttons, %d hops: about %.0f s, %.0f%% of the channel"
+          % (nodes, hops, fleet_s, 100 * airtime_s * nodes / fleet_s))
+    if fleet_s > CAMPAIGN_DURATION_S:
+        print("WARNING: longer than the coordinator's %d s campaign, some "
+              "buttons won't finish" % CAMPAIGN_DURATION_S)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("image", help="new firmware .bin")
+    parser.add_argument("--base", required=True,
+                        help="the .bin the buttons are running now")
+    parser.add_argument("port", nargs="?", help="coordinator's serial port")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--simulate", action="store_true",
+                        help="push to a stand-in coordinator and button")
+    parser.add_argument("--seed", type=int, default=0)
+    parser.add_argument("--report", type=int, metavar="N",
+                        help="estimate the cost of updating N buttons")
+    parser.add_argument("--hops", type=int, default=1,
+                        help="for --report, relays between coordinator and "
+                        "the furthest button, plus one")
+    parser.add_argument("--cancel", action="store_true",
+                        help="stop the coordinator offering any image")
+    args = parser.parse_args()
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    with open(args.base, "rb") as f:
+        base = f.read()
+    chunks = pack_chunks(encode_delta(base, image))
+    if len(chunks) > 0xFFFF:
+        sys.exit("Delta is too big")
+    offer = (
+        len(image),
+        0 if args.cancel else len(chunks),
+        hashlib.md5(image).digest(),
+        hashlib.md5(base).digest(),
+    )
+    if args.cancel:
+        chunks = []
+
+    if args.report:
+        report(image, chunks, args.report, args.hops)
+    if args.simulate:
+        simulate(base, image, offer, chunks, args.seed)
+    if args.port:
+        port = serial_records.open_source(args.port, args.baud)
+        push(port, offer, chunks)
+        if args.cancel:
+            print("Cancelled")
+        else:
+            print("Coordinator is offering image %04x" % image_id(offer[2]))
+    elif not args.report and not args.simulate:
+        parser.error("give a port, --simulate or --report")
+
+
+if __name__ == "__main__":
+    main()
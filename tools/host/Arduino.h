@@ -0,0 +1,104 @@
+// Host stand-ins for the parts of the ESP8266 Arduino core that src/main.cpp
+// uses, so it can run against the fake radio in tools/host/stress.cpp.
+// Implemented in platform.cpp, on a simulated clock.
+#pragma once
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+
+typedef uint8_t byte;
+
+#define D1 5
+#define D2 4
+#define D5 14
+#define A0 17
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define HEX 16
+#define ICACHE_RAM_ATTR
+#ifdef HOST_IRAM_SECTION // See tools/iram_report.py --host
+#define IRAM_ATTR __attribute__((section(".iram.text")))
+#else
+#define IRAM_ATTR
+#endif
+#define ICACHE_FLASH_ATTR
+#define PROGMEM
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+void noInterrupts();
+void interrupts();
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+int analogRead(int pin);
+void analogWrite(int pin, int value);
+void analogWriteRange(int range);
+void analogWriteFreq(int freq);
+
+class String {
+public:
+  String(const char *s = "") : s(s) {}
+  const char *c_str() const { return s.c_str(); }
+  String substring(int from, int to) const {
+    return String(s.substr(from, to - from).c_str());
+  }
+
+private:
+  std::string s;
+};
+
+class HardwareSerial {
+public:
+  void begin(unsigned long baud);
+  explicit operator bool() const { return true; }
+  size_t print(const char *s);
+  size_t print(long n, int base = 10);
+  size_t print(unsigned long n, int base = 10);
+  size_t print(int n, int base = 10) { return print((long)n, base); }
+  size_t print(unsigned int n, int base = 10) {
+    return print((unsigned long)n, base);
+  }
+  size_t print(double n, int digits = 2);
+  size_t println(const char *s = "");
+  template <typename T> size_t println(T n, int base = 10) {
+    return print(n, base) + println();
+  }
+  size_t printf(const char *format, ...);
+  size_t write(const uint8_t *data, size_t len);
+  size_t write(uint8_t byte) { return write(&byte, 1); }
+  int available();
+  int read();
+  void flush();
+};
+extern HardwareSerial Serial;
+
+enum RFMode { WAKE_RF_DEFAULT, WAKE_RFCAL, WAKE_NO_RFCAL, WAKE_RF_DISABLED };
+
+struct rst_info;
+class EspClass {
+public:
+  void deepSleepInstant(uint64_t us, RFMode mode = WAKE_RF_DEFAULT);
+  void deepSleep(uint64_t us, RFMode mode = WAKE_RF_DEFAULT);
+  bool rtcUserMemoryRead(uint32_t offset, uint32_t *data, size_t size);
+  bool rtcUserMemoryWrite(uint32_t offset, uint32_t *data, size_t size);
+  uint32_t getCycleCount();
+  uint8_t getCpuFreqMHz() { return 80; }
+  String getSketchMD5();
+  uint32_t getSketchSize();
+  struct rst_info *getResetInfoPtr(); // Always a power on
+  bool flashEraseSector(uint32_t sector);
+  bool flashWrite(uint32_t address, uint32_t *data, size_t size);
+  bool flashRead(uint32_t address, uint32_t *data, size_t size);
+  void restart();
+};
+extern EspClass ESP;
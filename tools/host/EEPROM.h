@@ -0,0 +1,24 @@
+// Host stand-in, see Arduino.h
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+class EEPROMClass {
+public:
+  void begin(size_t /*size*/) {}
+  bool commit() { return true; }
+  void end() {}
+  template <typename T> T &get(int address, T &value) {
+    memcpy(&value, data + address, sizeof(T));
+    return value;
+  }
+  template <typename T> const T &put(int address, const T &value) {
+    memcpy(data + address, &value, sizeof(T));
+    return value;
+  }
+
+private:
+  uint8_t data[4096] = {};
+};
+extern EEPROMClass EEPROM;
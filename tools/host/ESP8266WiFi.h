@@ -0,0 +1,13 @@
+// Host stand-in, see Arduino.h
+#pragma once
+#include <Arduino.h>
+
+enum WiFiMode_t { WIFI_OFF, WIFI_STA, WIFI_AP };
+
+class WiFiClass {
+public:
+  void mode(WiFiMode_t /*mode*/) {}
+  String macAddress();
+  uint8_t *macAddress(uint8_t *mac);
+};
+extern WiFiClass WiFi;
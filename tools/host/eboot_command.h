@@ -0,0 +1,12 @@
+// Host stand-in, see Arduino.h
+#pragma once
+#include <stdint.h>
+
+enum action_t { ACTION_COPY_RAW = 1, ACTION_LOAD_APP = 0xffffffff };
+struct eboot_command {
+  uint32_t magic;
+  enum action_t action;
+  uint32_t args[29];
+  uint32_t crc32;
+};
+extern "C" void eboot_command_write(struct eboot_command *cmd);
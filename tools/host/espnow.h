@@ -0,0 +1,27 @@
+// Host stand-in, see Arduino.h. Sends and receives go through the fake radio
+// in stress.cpp.
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint8_t u8;
+enum esp_now_role {
+  ESP_NOW_ROLE_IDLE,
+  ESP_NOW_ROLE_CONTROLLER,
+  ESP_NOW_ROLE_SLAVE,
+  ESP_NOW_ROLE_COMBO
+};
+typedef void (*esp_now_recv_cb_t)(uint8_t *mac, uint8_t *data, uint8_t len);
+int esp_now_init(void);
+int esp_now_set_self_role(uint8_t role);
+int esp_now_add_peer(uint8_t *mac, uint8_t role, uint8_t channel, uint8_t *key,
+                     uint8_t key_len);
+int esp_now_register_recv_cb(esp_now_recv_cb_t cb);
+int esp_now_send(uint8_t *da, uint8_t *data, int len);
+
+#ifdef __cplusplus
+}
+#endif
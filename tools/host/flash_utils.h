@@ -0,0 +1,3 @@
+// Host stand-in, see Arduino.h
+#pragma once
+#define FLASH_SECTOR_SIZE 0x1000
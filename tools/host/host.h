@@ -0,0 +1,22 @@
+// What platform.cpp needs from the harness, and what it offers it
+#pragma once
+#include <stdint.h>
+
+#include <espnow.h>
+
+// Simulated time. Nothing advances it but hostAdvance() and delay().
+extern uint64_t hostNow__us;
+void hostAdvance(uint64_t us);
+
+// Serial output costs time at the configured baud once the UART's FIFO is
+// full, like the real HardwareSerial
+extern bool hostEchoSerial;
+extern uint64_t hostSerialBytes;
+extern uint64_t hostSerialBlocked__us;
+
+extern uint8_t hostSelfMac[6];
+extern esp_now_recv_cb_t hostRecvCallback;
+
+// Implemented by the harness
+void hostOnYield();
+void hostOnSend(const uint8_t *data, int len);
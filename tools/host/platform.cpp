@@ -0,0 +1,212 @@
+// Fake ESP8266 for running src/main.cpp on a computer, see Arduino.h
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <ESP8266WiFi.h>
+#include <eboot_command.h>
+#include <espnow.h>
+#include <user_interface.h>
+
+#include "host.h"
+
+const int UART_FIFO_SIZE = 128;
+const uint32_t FLASH_SIZE = 4 << 20;
+
+uint64_t hostNow__us = 0;
+bool hostEchoSerial = false;
+uint64_t hostSerialBytes = 0;
+uint64_t hostSerialBlocked__us = 0;
+uint8_t hostSelfMac[6] = {0x5C, 0xCF, 0x7F, 0xC0, 0x00, 0x01};
+esp_now_recv_cb_t hostRecvCallback = NULL;
+
+HardwareSerial Serial;
+EspClass ESP;
+EEPROMClass EEPROM;
+WiFiClass WiFi;
+extern "C" {
+uint32_t _FS_start = 0;
+}
+
+static unsigned long uartBaud = 115200;
+static uint64_t uartEmptyAt__us = 0; // When the FIFO will have drained
+static uint8_t flash[FLASH_SIZE];
+
+void hostAdvance(uint64_t us) { hostNow__us += us; }
+
+unsigned long millis() { return hostNow__us / 1000; }
+unsigned long micros() { return hostNow__us; }
+
+void delay(unsigned long ms) {
+  hostAdvance(ms * 1000);
+  hostOnYield();
+}
+
+void delayMicroseconds(unsigned int us) { hostAdvance(us); }
+void yield() { hostOnYield(); }
+void noInterrupts() {}
+void interrupts() {}
+void pinMode(int /*pin*/, int /*mode*/) {}
+void digitalWrite(int /*pin*/, int /*value*/) {}
+int digitalRead(int /*pin*/) { return HIGH; } // Buttons pull up
+int analogRead(int /*pin*/) { return 0; }
+void analogWrite(int /*pin*/, int /*value*/) {}
+void analogWriteRange(int /*range*/) {}
+void analogWriteFreq(int /*freq*/) {}
+
+void HardwareSerial::begin(unsigned long baud) { uartBaud = baud; }
+
+size_t HardwareSerial::write(const uint8_t *data, size_t len) {
+  if (hostEchoSerial) {
+    fwrite(data, 1, len, stderr);
+  }
+  hostSerialBytes += len;
+  uint64_t byte__us = 10 * 1000000 / uartBaud; // 8N1
+  if (uartEmptyAt__us < hostNow__us) {
+    uartEmptyAt__us = hostNow__us;
+  }
+  uartEmptyAt__us += len * byte__us;
+  uint64_t fifo__us = UART_FIFO_SIZE * byte__us;
+  if (uartEmptyAt__us > hostNow__us + fifo__us) {
+    uint64_t blocked = uartEmptyAt__us - fifo__us - hostNow__us;
+    hostSerialBlocked__us += blocked;
+    hostAdvance(blocked);
+  }
+  return len;
+}
+
+size_t HardwareSerial::print(const char *s) {
+  return write((const uint8_t *)s, strlen(s));
+}
+
+size_t HardwareSerial::print(long n, int base) {
+  char buf[24];
+  snprintf(buf, sizeof(buf), base == HEX ? "%lx" : "%ld", n);
+  return print(buf);
+}
+
+size_t HardwareSerial::print(unsigned long n, int base) {
+  char buf[24];
+  snprintf(buf, sizeof(buf), base == HEX ? "%lx" : "%lu", n);
+  return print(buf);
+}
+
+size_t HardwareSerial::print(double n, int digits) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return print(buf);
+}
+
+size_t HardwareSerial::println(const char *s) { return print(s) + print("\n"); }
+
+size_t HardwareSerial::printf(const char *format, ...) {
+  char buf[256];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+  return print(buf);
+}
+
+int HardwareSerial::available() { return 0; }
+int HardwareSerial::read() { return -1; }
+void HardwareSerial::flush() {
+  if (uartEmptyAt__us > hostNow__us) {
+    hostAdvance(uartEmptyAt__us - hostNow__us);
+  }
+}
+
+void EspClass::deepSleepInstant(uint64_t /*us*/, RFMode /*mode*/) {
+  fprintf(stderr, "Deep sleep isn't simulated\n");
+  exit(1);
+}
+
+void EspClass::deepSleep(uint64_t us, RFMode /*mode*/) { deepSleepInstant(us); }
+
+// Always a cold boot
+bool EspClass::rtcUserMemoryRead(uint32_t /*offset*/, uint32_t *data,
+                                 size_t size) {
+  memset(data, 0, size);
+  return true;
+}
+
+bool EspClass::rtcUserMemoryWrite(uint32_t /*offset*/, uint32_t * /*data*/,
+                                  size_t /*size*/) {
+  return true;
+}
+
+uint32_t EspClass::getCycleCount() {
+  return hostNow__us * getCpuFreqMHz();
+}
+
+String EspClass::getSketchMD5() { return String("host"); }
+uint32_t EspClass::getSketchSize() { return 512 << 10; }
+
+struct rst_info *EspClass::getResetInfoPtr() {
+  static rst_info info = {REASON_DEFAULT_RST};
+  return &info;
+}
+
+bool EspClass::flashEraseSector(uint32_t sector) {
+  if ((sector + 1) * 0x1000 > FLASH_SIZE) {
+    return false;
+  }
+  memset(flash + sector * 0x1000, 0xFF, 0x1000);
+  return true;
+}
+
+bool EspClass::flashWrite(uint32_t address, uint32_t *data, size_t size) {
+  if (address + size > FLASH_SIZE) {
+    return false;
+  }
+  memcpy(flash + address, data, size);
+  return true;
+}
+
+bool EspClass::flashRead(uint32_t address, uint32_t *data, size_t size) {
+  if (address + size > FLASH_SIZE) {
+    return false;
+  }
+  memcpy(data, flash + address, size);
+  return true;
+}
+
+void EspClass::restart() {
+  fprintf(stderr, "Restarts aren't simulated\n");
+  exit(1);
+}
+
+extern "C" void eboot_command_write(struct eboot_command * /*cmd*/) {}
+
+String WiFiClass::macAddress() {
+  char buf[18];
+  snprintf(buf, sizeof(buf), "%02X:%02X:%02X:%02X:%02X:%02X", hostSelfMac[0],
+           hostSelfMac[1], hostSelfMac[2], hostSelfMac[3], hostSelfMac[4],
+           hostSelfMac[5]);
+  return String(buf);
+}
+
+uint8_t *WiFiClass::macAddress(uint8_t *mac) {
+  memcpy(mac, hostSelfMac, 6);
+  return mac;
+}
+
+int esp_now_init(void) { return 0; }
+int esp_now_set_self_role(uint8_t /*role*/) { return 0; }
+int esp_now_add_peer(uint8_t * /*mac*/, uint8_t /*role*/, uint8_t /*channel*/,
+                     uint8_t * /*key*/, uint8_t /*key_len*/) {
+  return 0;
+}
+
+int esp_now_register_recv_cb(esp_now_recv_cb_t cb) {
+  hostRecvCallback = cb;
+  return 0;
+}
+
+int esp_now_send(uint8_t * /*da*/, uint8_t *data, int len) {
+  hostOnSend(data, len);
+  return 0;
+}
+
+bool wifi_set_opmode(uint8_t /*mode*/) { return true; }
+void wifi_promiscuous_enable(uint8_t /*promiscuous*/) {}
+void wifi_set_promiscuous_rx_cb(wifi_promiscuous_cb_t /*cb*/) {}
+bool wifi_set_channel(uint8_t /*channel*/) { return true; }
@@ -0,0 +1,271 @@
+// Floods a host build of the coordinator with pressed frames, see
+// tools/stress.py, which builds and runs this. FIRMWARE_SOURCE is a copy of
+// src/main.cpp with IS_COORDINATOR set.
+//
+// The fake radio shares one channel between every sender and the
+// coordinator, at ESP-NOW's 1 Mbit/s. Frames wait for the channel to be free
+// (no collisions), then land in an RX queue of rx_queue frames. The firmware
+// only gets them when its loop yields, like on the ESP8266, and each callback
+// costs callback_us of CPU time on top of any time spent blocked on serial
+// output. Frames that arrive to a full queue are dropped.
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "host.h"
+
+#include FIRMWARE_SOURCE
+
+struct HostDone {};
+
+struct Arrival {
+  uint64_t ready__us; // When the sender wanted to send it
+  uint64_t received__us;
+  uint64_t replied__us; // End of the coordinator's first reply, 0 if none
+  uint8_t sender;
+  uint8_t len;
+  uint8_t data[MAX_FRAME_LEN];
+};
+
+struct Config {
+  double rate = 200;       // Offered pressed frames per second
+  double duration = 5;     // Seconds of traffic
+  int senders = 20;        // Synthetic buttons, each with its own MAC
+  int doors = 1;           // Spread across this many doors
+  int telemetryEvery = 10; // Every nth frame from a sender has telemetry
+  int rxQueue = 8;
+  uint64_t callback__us = 100;
+  uint64_t loop__us = 10; // One pass of setupCoordinator()'s loop
+  uint32_t seed = 1;
+};
+
+Config config;
+std::vector<Arrival> arrivals;
+size_t nextArrival = 0;      // Not yet on air
+std::deque<size_t> inFlight; // On air, by when they land
+std::deque<size_t> rxQueue;  // Waiting for the callback
+uint64_t channelFreeAt__us = 0;
+uint64_t channelBusy__us = 0;
+long currentArrival = -1; // Whose callback is running
+uint64_t trafficStart__us = 0;
+uint64_t trafficEnd__us = 0;
+uint64_t stopAt__us = 0;
+bool inYield = false;
+
+size_t dropped = 0;
+size_t processed = 0;
+size_t maxRxQueue = 0;
+size_t txFrames = 0;
+uint64_t maxTxBacklog__us = 0;
+
+uint64_t airtime__us(int len) {
+  // 802.11 header, ESP-NOW headers and FCS, at 1 Mbit/s with long preamble
+  return 192 + 8 * (len + 43);
+}
+
+void senderMac(uint8_t sender, uint8_t *mac) {
+  const uint8_t base[6] = {0x02, 0xD0, 0x0D, 0x00, 0x00, 0x00};
+  memcpy(mac, base, 6);
+  mac[5] = sender;
+}
+
+void buildArrivals() {
+  std::mt19937 random(config.seed);
+  std::exponential_distribution<double> gap(config.rate);
+  std::vector<uint32_t> counters(config.senders, 1);
+  double t = trafficStart__us * 1e-6;
+  int i = 0;
+  while (true) {
+    t += gap(random);
+    if (t * 1e6 > trafficEnd__us) {
+      break;
+    }
+    Arrival arrival = {};
+    arrival.ready__us = t * 1e6;
+    arrival.sender = i++ % config.senders;
+    uint8_t door = arrival.sender % config.doors;
+    uint8_t mac[6];
+    senderMac(arrival.sender, mac);
+
+    DataStruct data = {};
+    data.group_id = GROUP_ID;
+    data.door_id = door;
+    data.counter = counters[arrival.sender]++;
+    data.battery = encodeBattery(3900);
+    // Every sender relays the press of the door's first button
+    senderMac(door, data.button_pressed_mac);
+    int len = sizeof(DataStruct);
+    if (config.telemetryEvery > 0 &&
+        data.counter % config.telemetryEvery == 0) {
+      data.flags |= FRAME_HAS_TELEMETRY;
+      TelemetryStruct telemetry = {};
+      memcpy(telemetry.node_mac, mac, 6);
+      telemetry.dashes = 1;
+      telemetry.tx_frames = data.counter;
+      memcpy(arrival.data + len, &telemetry, sizeof(telemetry));
+      len += sizeof(telemetry);
+    }
+    memcpy(arrival.data, &data, sizeof(data));
+    computeTag(mac, arrival.data, len, arrival.data + len);
+    arrival.len = len + FRAME_TAG_LEN;
+    arrivals.push_back(arrival);
+  }
+}
+
+// Puts frames the senders want to send by now on the channel, in order
+void scheduleChannel() {
+  while (nextArrival < arrivals.size() &&
+         arrivals[nextArrival].ready__us <= hostNow__us) {
+    Arrival *arrival = &arrivals[nextArrival];
+    uint64_t start = std::max(arrival->ready__us, channelFreeAt__us);
+    uint64_t air = airtime__us(arrival->len);
+    channelFreeAt__us = start + air;
+    channelBusy__us += air;
+    arrival->received__us = start + air;
+    inFlight.push_back(nextArrival++);
+  }
+}
+
+void deliver() {
+  while (!inFlight.empty() &&
+         arrivals[inFlight.front()].received__us <= hostNow__us) {
+    if ((int)rxQueue.size() < config.rxQueue) {
+      rxQueue.push_back(inFlight.front());
+      maxRxQueue = std::max(maxRxQueue, rxQueue.size());
+    } else {
+      dropped++;
+    }
+    inFlight.pop_front();
+  }
+}
+
+void hostOnSend(const uint8_t * /*data*/, int len) {
+  scheduleChannel();
+  uint64_t start = std::max(hostNow__us, channelFreeAt__us);
+  maxTxBacklog__us = std::max(maxTxBacklog__us, start - hostNow__us);
+  uint64_t air = airtime__us(len);
+  channelFreeAt__us = start + air;
+  channelBusy__us += air;
+  txFrames++;
+  if (currentArrival >= 0 && arrivals[currentArrival].replied__us == 0) {
+    arrivals[currentArrival].replied__us = start + air;
+  }
+}
+
+void hostOnYield() {
+  if (inYield) {
+    return;
+  }
+  inYield = true;
+  hostAdvance(config.loop__us);
+  scheduleChannel();
+  deliver();
+  while (!rxQueue.empty()) {
+    currentArrival = rxQueue.front();
+    rxQueue.pop_front();
+    Arrival *arrival = &arrivals[currentArrival];
+    uint8_t mac[6];
+    senderMac(arrival->sender, mac);
+    hostAdvance(config.callback__us);
+    hostRecvCallback(mac, arrival->data, arrival->len);
+    processed++;
+    currentArrival = -1;
+    scheduleChannel();
+    deliver();
+  }
+  if (hostNow__us > stopAt__us) {
+    throw HostDone();
+  }
+  inYield = false;
+}
+
+double percentile(std::vector<uint64_t> &values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  size_t i = std::min(values.size() - 1, (size_t)(p * values.size()));
+  return values[i] * 1e-3;
+}
+
+void report() {
+  double seconds = (trafficEnd__us - trafficStart__us) * 1e-6;
+  std::vector<uint64_t> latencies;
+  size_t onAir = 0;
+  for (size_t i = 0; i < nextArrival; i++) {
+    onAir += arrivals[i].received__us <= stopAt__us;
+    if (arrivals[i].replied__us != 0) {
+      latencies.push_back(arrivals[i].replied__us - arrivals[i].ready__us);
+    }
+  }
+  std::sort(latencies.begin(), latencies.end());
+  printf("offered=%zu\n", arrivals.size());
+  printf("offered_fps=%.1f\n", arrivals.size() / seconds);
+  printf("on_air=%zu\n", onAir);
+  printf("dropped=%zu\n", dropped);
+  printf("processed=%zu\n", processed);
+  printf("processed_fps=%.1f\n", processed / seconds);
+  printf("replied=%zu\n", latencies.size());
+  printf("latency_p50_ms=%.2f\n", percentile(latencies, 0.5));
+  printf("latency_p90_ms=%.2f\n", percentile(latencies, 0.9));
+  printf("latency_p99_ms=%.2f\n", percentile(latencies, 0.99));
+  printf("latency_max_ms=%.2f\n", percentile(latencies, 1));
+  printf("max_rx_queue=%zu\n", maxRxQueue);
+  printf("tx_frames=%zu\n", txFrames);
+  printf("max_tx_backlog_ms=%.2f\n", maxTxBacklog__us * 1e-3);
+  uint64_t end__us = std::max(stopAt__us, channelFreeAt__us);
+  printf("channel_utilization=%.3f\n",
+         (double)channelBusy__us / (end__us - trafficStart__us));
+  printf("serial_bytes=%llu\n", (unsigned long long)hostSerialBytes);
+  printf("serial_blocked_ms=%.2f\n", hostSerialBlocked__us * 1e-3);
+}
+
+int main(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    char key[32];
+    double value;
+    if (sscanf(argv[i], "%31[^=]=%lf", key, &value) != 2) {
+      fprintf(stderr, "Expected key=value, got %s\n", argv[i]);
+      return 2;
+    }
+    std::string name = key;
+    if (name == "rate") {
+      config.rate = value;
+    } else if (name == "duration") {
+      config.duration = value;
+    } else if (name == "senders") {
+      config.senders = std::min(255, (int)value);
+    } else if (name == "doors") {
+      config.doors = value;
+    } else if (name == "telemetry_every") {
+      config.telemetryEvery = value;
+    } else if (name == "rx_queue") {
+      config.rxQueue = value;
+    } else if (name == "callback_us") {
+      config.callback__us = value;
+    } else if (name == "loop_us") {
+      config.loop__us = std::max(1.0, value);
+    } else if (name == "seed") {
+      config.seed = value;
+    } else if (name == "echo") {
+      hostEchoSerial = value != 0;
+    } else {
+      fprintf(stderr, "Unknown setting %s\n", key);
+      return 2;
+    }
+  }
+  if (config.doors > NUM_DOORS || config.doors > config.senders) {
+    fprintf(stderr, "Need NUM_DOORS >= doors and senders >= doors\n");
+    return 2;
+  }
+  trafficStart__us = 100000; // Let setup() finish first
+  trafficEnd__us = trafficStart__us + config.duration * 1e6;
+  stopAt__us = trafficEnd__us + 200000; // Let in flight frames drain
+  buildArrivals();
+  try {
+    setup();
+  } catch (HostDone &) {
+  }
+  report();
+  return 0;
+}
@@ -0,0 +1,31 @@
+// Helpers for the host tests, see tools/test.py. Include after
+// FIRMWARE_SOURCE.
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+
+#define CHECK(condition)                                                      \
+  do {                                                                        \
+    if (!(condition)) {                                                       \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__,        \
+              #condition);                                                    \
+      exit(1);                                                                \
+    }                                                                         \
+  } while (0)
+
+// A made up node's MAC, distinct from hostSelfMac
+inline void testMac(uint8_t node, uint8_t *mac) {
+  const uint8_t base[6] = {0x02, 0xD0, 0x0D, 0x00, 0x00, 0x00};
+  memcpy(mac, base, 6);
+  mac[5] = node;
+}
+
+// Signs a frame from node as the firmware would, and returns its length
+inline int testFrame(uint8_t node, DataStruct *data, uint8_t *frame) {
+  uint8_t mac[6];
+  testMac(node, mac);
+  data->group_id = GROUP_ID;
+  memcpy(frame, data, sizeof(DataStruct));
+  computeTag(mac, frame, sizeof(DataStruct), frame + sizeof(DataStruct));
+  return sizeof(DataStruct) + FRAME_TAG_LEN;
+}
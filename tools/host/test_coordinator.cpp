@@ -0,0 +1,58 @@
+// Winner frames repeated by relays and buttons aren't presses, so they must
+// not start a dash on the coordinator
+//
+// Firmware: IS_COORDINATOR=true
+#include "host.h"
+
+#include FIRMWARE_SOURCE
+
+#include "test.h"
+
+struct HostDone {};
+
+const uint8_t BUTTON = 1;
+const uint8_t RELAY = 2;
+
+uint64_t stopAt__us = 0;
+bool delivered = false;
+int dashFramesSent = 0;
+
+// Anything but timing and firmware frames
+void hostOnSend(const uint8_t *frame, int len) {
+  DataStruct data;
+  memcpy(&data, frame, sizeof(data));
+  if (len >= (int)sizeof(data) &&
+      !(data.flags & (FRAME_TIMING | FRAME_FIRMWARE))) {
+    dashFramesSent++;
+  }
+}
+
+void hostOnYield() {
+  hostAdvance(100);
+  if (!delivered && hostNow__us > 100000) {
+    // A relay repeating the winner of an earlier dash
+    DataStruct data = {};
+    data.counter = 1;
+    testMac(BUTTON, data.winner_mac);
+    uint8_t mac[6];
+    testMac(RELAY, mac);
+    uint8_t frame[MAX_FRAME_LEN];
+    int len = testFrame(RELAY, &data, frame);
+    hostRecvCallback(mac, frame, len);
+    delivered = true;
+  }
+  if (hostNow__us > stopAt__us) {
+    throw HostDone();
+  }
+}
+
+int main() {
+  stopAt__us = 1000000;
+  try {
+    setup();
+  } catch (HostDone &) {
+  }
+  CHECK(delivered);
+  CHECK(dashFramesSent == 0);
+  return 0;
+}
@@ -0,0 +1,45 @@
+// The main loop must reserve the next block of frame counters before the
+// current one runs out, so sendFrame never writes EEPROM from a callback
+//
+// Firmware: IS_COORDINATOR=true
+#include "host.h"
+
+#include FIRMWARE_SOURCE
+
+#include "test.h"
+
+struct HostDone {};
+
+uint32_t firstCeiling = 0;
+uint32_t counterAtReservation = 0;
+
+void hostOnSend(const uint8_t *, int) {}
+
+void hostOnYield() {
+  hostAdvance(100);
+  if (firstCeiling == 0) {
+    firstCeiling = rtcState.frameCounterCeiling;
+    rtcState.frameCounter = firstCeiling - FRAME_COUNTER_LOW_WATER;
+  } else if (counterAtReservation == 0 &&
+             rtcState.frameCounterCeiling != firstCeiling) {
+    counterAtReservation = rtcState.frameCounter;
+  }
+  if (hostNow__us > 1000000) {
+    throw HostDone();
+  }
+}
+
+int main() {
+  try {
+    setup();
+  } catch (HostDone &) {
+  }
+  CHECK(firstCeiling == FRAME_COUNTER_RESERVATION); // Reserved on cold boot
+  CHECK(counterAtReservation != 0);
+  CHECK(counterAtReservation < firstCeiling);
+  uint32_t reserved = 0;
+  EEPROM.get(EEPROM_FRAME_COUNTER_ADDR, reserved);
+  CHECK(reserved == rtcState.frameCounterCeiling);
+  CHECK(reserved >= counterAtReservation + FRAME_COUNTER_RESERVATION);
+  return 0;
+}
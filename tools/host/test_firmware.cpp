@@ -0,0 +1,161 @@
+// A delta update staged by the firmware's own decoder must match the new image
+// byte for byte, through a dropped chunk, a bad chunk that had already flushed
+// a sector, and a resume on a later wake
+#include "host.h"
+
+#include FIRMWARE_SOURCE
+
+#include "test.h"
+
+#include <vector>
+
+void hostOnYield() {}
+void hostOnSend(const uint8_t *, int) {}
+
+const uint32_t BASE_SIZE = 16 << 10;
+const uint32_t STAGING_ADDRESS = 1 << 20;
+const uint16_t IMAGE_ID = 0x1234;
+
+uint32_t seed = 1;
+uint8_t randomByte() {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+// Builds new.bin and the chunks that rebuild it from base, op by op
+struct Delta {
+  std::vector<uint8_t> base;
+  std::vector<uint8_t> image;
+  std::vector<std::vector<uint8_t>> chunks;
+
+  void startChunk() {
+    uint32_t position = image.size();
+    chunks.push_back(std::vector<uint8_t>((uint8_t *)&position,
+                                          (uint8_t *)&position + 4));
+  }
+  void add(std::initializer_list<uint8_t> bytes) {
+    chunks.back().insert(chunks.back().end(), bytes);
+  }
+  void literal(int count, uint8_t first) {
+    add({(uint8_t)(count - 1)});
+    for (int i = 0; i < count; i++) {
+      uint8_t byte = i == 0 ? first : randomByte();
+      add({byte});
+      image.push_back(byte);
+    }
+  }
+  void copy(uint8_t op, uint32_t source, uint16_t count) {
+    add({op, (uint8_t)source, (uint8_t)(source >> 8), (uint8_t)(source >> 16),
+         (uint8_t)count, (uint8_t)(count >> 8)});
+    for (int i = 0; i < count; i++) { // One at a time, copies may overlap
+      image.push_back(op == FIRMWARE_OP_COPY_OLD ? base[source + i]
+                                                 : image[source + i]);
+    }
+  }
+  void fill(uint16_t count, uint8_t byte) {
+    add({FIRMWARE_OP_FILL, (uint8_t)count, (uint8_t)(count >> 8), byte});
+    image.insert(image.end(), count, byte);
+  }
+};
+
+// Hands a chunk to the receive path, and applies it if it was taken
+bool deliver(uint16_t index, const std::vector<uint8_t> &body) {
+  CHECK((int)body.size() <= FIRMWARE_CHUNK_MAX_BODY);
+  uint8_t frame[MAX_FRAME_LEN];
+  FirmwareStruct *firmware = (FirmwareStruct *)frame;
+  firmware->kind = FIRMWARE_CHUNK;
+  firmware->image_id = IMAGE_ID;
+  firmware->chunk = index;
+  memcpy(frame + sizeof(FirmwareStruct), body.data(), body.size());
+  handleFirmwareFrame(firmware, body.size());
+  if (!globalChunkReady) {
+    return false;
+  }
+  applyReceivedChunk();
+  return true;
+}
+
+int main() {
+  Delta delta;
+  for (uint32_t i = 0; i < BASE_SIZE; i++) {
+    delta.base.push_back(randomByte());
+  }
+  uint32_t base[BASE_SIZE / 4];
+  memcpy(base, delta.base.data(), BASE_SIZE);
+  ESP.flashWrite(0, base, BASE_SIZE); // The running sketch
+
+  delta.startChunk();
+  delta.literal(100, 0xE9); // Image header magic
+  delta.copy(FIRMWARE_OP_COPY_OLD, 500, 3000);
+  delta.startChunk(); // Flushes the first sector
+  delta.fill(1500, 0x00);
+  delta.copy(FIRMWARE_OP_COPY_NEW, delta.image.size() - 3, 300);
+  delta.startChunk(); // Reads back across the flushed sector's end
+  delta.copy(FIRMWARE_OP_COPY_NEW, 3900, 900);
+  delta.literal(50, randomByte());
+  delta.copy(FIRMWARE_OP_COPY_OLD, 6000, 2600);
+  CHECK(delta.image.size() > 2 * FLASH_SECTOR_SIZE);
+  delta.startChunk();
+  delta.literal(128, randomByte());
+  delta.fill(1000, 0xFF);
+  delta.copy(FIRMWARE_OP_COPY_OLD, 9000, 1530);
+  // Chunk 2 again, with a bad op after it has flushed the second sector
+  std::vector<uint8_t> badChunk = delta.chunks[2];
+  badChunk.push_back(0x90);
+
+  globalState = FIRMWARE_UPDATE;
+  globalOfferImageId = IMAGE_ID;
+  globalOffer.image_size = delta.image.size();
+  globalOffer.chunk_count = delta.chunks.size();
+  memset(globalOffer.image_md5, 0, 16); // The host's MD5Builder gives zeros
+  globalStagingAddress = STAGING_ADDRESS;
+  resumeFirmwareStaging();
+
+  CHECK(deliver(0, delta.chunks[0]));
+  CHECK(deliver(1, delta.chunks[1]));
+  CHECK(globalOtaNextChunk == 2);
+  CHECK(rtcState.otaFlushed == FLASH_SECTOR_SIZE);
+
+  // Chunk 2 was dropped, so chunk 3 isn't taken
+  CHECK(!deliver(3, delta.chunks[3]));
+  CHECK(globalOtaNextChunk == 2);
+
+  uint32_t written = globalOtaWritten;
+  CHECK(deliver(2, badChunk));
+  CHECK(globalOtaNextChunk == 2);
+  CHECK(rtcState.otaBadChunks == 1);
+  CHECK(globalOtaWritten == written);
+  CHECK(globalOtaSectorStart == FLASH_SECTOR_SIZE);
+  CHECK(rtcState.otaFlushed == FLASH_SECTOR_SIZE);
+  CHECK(rtcState.otaResumeChunk == 1);
+
+  CHECK(deliver(2, delta.chunks[2]));
+  CHECK(globalOtaNextChunk == 3);
+  CHECK(rtcState.otaFlushed == 2 * FLASH_SECTOR_SIZE);
+
+  // The wake ends. The next one resumes from the last flushed sector, which
+  // chunk 2 started before.
+  globalOtaNextChunk = 0;
+  globalOtaWritten = 0;
+  memset(globalOtaSector, 0xAA, sizeof(globalOtaSector));
+  resumeFirmwareStaging();
+  CHECK(globalOtaNextChunk == 2);
+  CHECK(globalOtaWritten == 2 * FLASH_SECTOR_SIZE);
+  CHECK(deliver(2, delta.chunks[2]));
+  CHECK(deliver(3, delta.chunks[3]));
+  CHECK(globalOtaNextChunk == globalOffer.chunk_count);
+  CHECK(globalOtaWritten == delta.image.size());
+  flushFirmwareSector(); // As finishFirmwareUpdate() does for the last one
+
+  for (uint32_t offset = 0; offset < delta.image.size(); offset++) {
+    uint8_t byte;
+    readFlash(STAGING_ADDRESS + offset, &byte, 1);
+    if (byte != delta.image[offset]) {
+      fprintf(stderr, "Staged byte %u is %02x, not %02x\n", offset, byte,
+              delta.image[offset]);
+      return 1;
+    }
+  }
+  CHECK(isStagedFirmwareValid());
+  return 0;
+}
@@ -0,0 +1,40 @@
+// Each LED pattern, shown for a whole dash and its cool down, must average no
+// more than its budget. Scales are only worked out once a pattern is shown.
+#include "host.h"
+
+#include FIRMWARE_SOURCE
+
+#include "test.h"
+
+void hostOnYield() {}
+void hostOnSend(const uint8_t *, int) {}
+
+int main() {
+  rtcState.timing = TIMING_PROFILES[PROFILE_BALANCED];
+  unsigned long dash__ms =
+      rtcState.timing.flashDuration__ms + rtcState.timing.coolDown__ms;
+  for (int id = 0; id < NUM_LED_PATTERNS; id++) {
+    CHECK(globalLedScale[id] == 0);
+  }
+
+  for (int id = 0; id < NUM_LED_PATTERNS; id++) {
+    globalDoorDashStartedAt = millis();
+    while (millis() - globalDoorDashStartedAt < dash__ms) {
+      ledShow((LedPatternId_t)id);
+      hostAdvance(100); // About one pass of the button loop
+    }
+    ledOff();
+    const LedPattern *pattern = &LED_PATTERNS[id];
+    LedUsage *usage = &globalLedUsage[id];
+    CHECK(usage->shown__us >= dash__ms * 1000);
+    uint32_t average__ua = usage->charge__pc / usage->shown__us;
+    if (pattern->budget__ua > 0) {
+      CHECK(average__ua <= pattern->budget__ua);
+    }
+    // Dimmed to fit, not far below it
+    if (globalLedScale[id] < 1) {
+      CHECK(average__ua >= pattern->budget__ua * 95 / 100);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,51 @@
+// A press from a node the coordinator hasn't heard before must not print from
+// the receive callback. The loop reports the node and the winner afterwards.
+//
+// Firmware: IS_COORDINATOR=true
+#include "host.h"
+
+#include FIRMWARE_SOURCE
+
+#include "test.h"
+
+struct HostDone {};
+
+const uint8_t BUTTON = 1;
+
+bool delivered = false;
+uint64_t callbackSerialBytes = 0;
+
+void hostOnSend(const uint8_t *, int) {}
+
+void hostOnYield() {
+  hostAdvance(100);
+  if (!delivered && hostNow__us > 100000) {
+    DataStruct data = {};
+    data.counter = 1;
+    testMac(BUTTON, data.button_pressed_mac);
+    uint8_t mac[6];
+    testMac(BUTTON, mac);
+    uint8_t frame[MAX_FRAME_LEN];
+    int len = testFrame(BUTTON, &data, frame);
+    uint64_t before = hostSerialBytes;
+    hostRecvCallback(mac, frame, len);
+    callbackSerialBytes = hostSerialBytes - before;
+    delivered = true;
+  }
+  if (hostNow__us > 200000) {
+    throw HostDone();
+  }
+}
+
+int main() {
+  try {
+    setup();
+  } catch (HostDone &) {
+  }
+  CHECK(delivered);
+  CHECK(globalDashes[0].hasDeclaredWinner);
+  CHECK(callbackSerialBytes == 0);
+  CHECK(globalNodes[0].heard && globalNodes[0].announced);
+  CHECK(globalDashes[0].announced);
+  return 0;
+}
@@ -0,0 +1,121 @@
+// Two mains relays in range of each other must stop relaying once a dash is
+// over, rather than re-arming each other from each other's winner frames
+//
+// Firmware: NODE_CLASS=NODE_MAINS_RELAY
+#include <deque>
+
+#include "host.h"
+
+#include FIRMWARE_SOURCE
+
+#include "test.h"
+
+struct HostDone {};
+
+struct Heard {
+  uint64_t at__us;
+  uint8_t node;
+  DataStruct data;
+};
+
+const uint8_t BUTTON = 1;
+const uint8_t COORDINATOR = 2;
+
+// The other relay, as relays were before they cooled down: it repeats the
+// first winner it hears for flashDuration__ms, then is ready to be armed again.
+// It's out of the coordinator's range and loses our first few frames, so its
+// dash ends a little after ours.
+const uint8_t OTHER_RELAY = 3;
+const uint64_t OTHER_LOSES__us = 100000;
+struct OtherRelay {
+  bool armed;
+  uint64_t heardAt__us;
+  uint64_t sentAt__us;
+  DataStruct winner;
+  uint32_t counter;
+};
+OtherRelay other = {};
+
+std::deque<Heard> pending; // By time
+uint64_t lastWinnerSent__us = 0;
+uint64_t firstWinnerSent__us = 0;
+uint64_t stopAt__us = 0;
+
+void hostOnSend(const uint8_t *frame, int len) {
+  DataStruct data;
+  memcpy(&data, frame, sizeof(data));
+  if (len < (int)sizeof(data) || !isWinnerMsg(&data) ||
+      (data.flags & (FRAME_TIMING | FRAME_FIRMWARE))) {
+    return;
+  }
+  if (firstWinnerSent__us == 0) {
+    firstWinnerSent__us = hostNow__us;
+  }
+  lastWinnerSent__us = hostNow__us;
+  if (!other.armed && hostNow__us - firstWinnerSent__us > OTHER_LOSES__us) {
+    other.armed = true;
+    other.heardAt__us = hostNow__us;
+    other.winner = data;
+    other.winner.flags = 0;
+  }
+}
+
+void deliver(Heard *heard) {
+  uint8_t mac[6];
+  testMac(heard->node, mac);
+  uint8_t frame[MAX_FRAME_LEN];
+  int len = testFrame(heard->node, &heard->data, frame);
+  hostRecvCallback(mac, frame, len);
+}
+
+void hostOnYield() {
+  hostAdvance(100);
+  while (!pending.empty() && pending.front().at__us <= hostNow__us) {
+    Heard heard = pending.front();
+    pending.pop_front();
+    deliver(&heard);
+  }
+  uint64_t flash__us = rtcState.timing.flashDuration__ms * 1000ULL;
+  uint64_t interval__us = rtcState.timing.rebroadcastInterval__ms * 1000ULL;
+  if (other.armed && hostNow__us - other.heardAt__us > flash__us) {
+    other.armed = false;
+  } else if (other.armed && hostNow__us - other.sentAt__us > interval__us) {
+    Heard heard = {hostNow__us, OTHER_RELAY, other.winner};
+    heard.data.counter = ++other.counter;
+    deliver(&heard);
+    other.sentAt__us = hostNow__us;
+  }
+  if (hostNow__us > stopAt__us) {
+    throw HostDone();
+  }
+}
+
+int main() {
+  rtcState.timing = TIMING_PROFILES[PROFILE_BALANCED];
+  uint64_t flash__us = rtcState.timing.flashDuration__ms * 1000ULL;
+  uint64_t coolDown__us = coolDown__ms() * 1000ULL;
+
+  // A press, then the coordinator's winner, on the last door relays handle
+  Heard press = {100000, BUTTON, {}};
+  press.data.door_id = RELAY_NUM_DOORS - 1;
+  press.data.counter = 1;
+  testMac(BUTTON, press.data.button_pressed_mac);
+  Heard winner = press;
+  winner.at__us = 150000;
+  winner.node = COORDINATOR;
+  testMac(BUTTON, winner.data.winner_mac);
+  pending.push_back(press);
+  pending.push_back(winner);
+
+  stopAt__us = 3 * (flash__us + coolDown__us);
+  try {
+    setupMainsRelay();
+  } catch (HostDone &) {
+  }
+  // Relayed the winner for the dash, and stopped once it was over
+  CHECK(firstWinnerSent__us != 0);
+  CHECK(firstWinnerSent__us < 200000);
+  CHECK(lastWinnerSent__us > flash__us);
+  CHECK(lastWinnerSent__us < 200000 + flash__us);
+  return 0;
+}
@@ -0,0 +1,56 @@
+// More senders than the replay table has slots must not let a captured frame
+// through
+#include "host.h"
+
+#include FIRMWARE_SOURCE
+
+#include "test.h"
+
+void hostOnYield() {}
+void hostOnSend(const uint8_t *, int) {}
+
+// Sends node's frame with this counter, and returns whether it was accepted
+bool accepts(uint8_t node, uint32_t counter) {
+  DataStruct data = {};
+  data.counter = counter;
+  uint8_t frame[MAX_FRAME_LEN];
+  int len = testFrame(node, &data, frame);
+  uint8_t mac[6];
+  testMac(node, mac);
+  return verifyFrame(mac, frame, len);
+}
+
+int main() {
+  rtcState.timing = TIMING_PROFILES[PROFILE_BALANCED];
+  unsigned long dash__ms = rtcState.timing.coordinationDuration__ms;
+  const int senders = REPLAY_TABLE_SIZE + 4;
+
+  // A busy dash: every slot is taken by a sender heard in this dash, so the
+  // extra senders can't push anyone out
+  for (int node = 0; node < senders; node++) {
+    CHECK(accepts(node, 1) == (node < REPLAY_TABLE_SIZE));
+  }
+  for (int node = 0; node < REPLAY_TABLE_SIZE; node++) {
+    CHECK(!accepts(node, 1));
+  }
+
+  // Node 0 keeps sending, the rest go quiet
+  hostAdvance(dash__ms * 1000 / 2);
+  CHECK(accepts(0, 2));
+  hostAdvance(dash__ms * 1000 / 2 + 1000);
+
+  // Quiet senders make room, least recently heard first. Node 0 keeps its
+  // slot, so its captured frames are still rejected.
+  for (int node = REPLAY_TABLE_SIZE; node < senders; node++) {
+    CHECK(accepts(node, 1));
+  }
+  CHECK(!accepts(0, 2));
+  CHECK(!accepts(0, 1));
+  CHECK(accepts(0, 3));
+
+  // Replays survive deep sleep: the clock keeps counting across it
+  rtcState.clock__ms = replayClock__ms() + 2000;
+  hostNow__us = 0;
+  CHECK(!accepts(0, 3));
+  return 0;
+}
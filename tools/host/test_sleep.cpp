@@ -0,0 +1,30 @@
+// A node sleeping longer to save its battery must still wake within the time
+// the LED shows a dash for, or it misses the dash
+#include "host.h"
+
+#include FIRMWARE_SOURCE
+
+#include "test.h"
+
+void hostOnYield() {}
+void hostOnSend(const uint8_t *, int) {}
+
+int main() {
+  for (const TimingConfig &profile : TIMING_PROFILES) {
+    CHECK(isTimingValid(&profile));
+    rtcState.timing = profile;
+    for (int mode = POWER_NORMAL; mode <= POWER_CRITICAL; mode++) {
+      rtcState.powerMode = mode;
+      CHECK(sleepDuration__us() >= profile.sleepDuration__us);
+      CHECK(sleepDuration__us() <= profile.flashDuration__ms * 1000UL);
+    }
+  }
+
+  // 2 s of sleep against a 5 s flash is valid, but 4 times the sleep isn't
+  rtcState.timing = TIMING_PROFILES[PROFILE_BALANCED];
+  rtcState.powerMode = POWER_CRITICAL;
+  CHECK(sleepDuration__us() == 5000000);
+  rtcState.powerMode = POWER_SAVER;
+  CHECK(sleepDuration__us() == 4000000);
+  return 0;
+}
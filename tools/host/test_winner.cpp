@@ -0,0 +1,62 @@
+// A pressed leaf that wins must keep repeating its winner frame, even though
+// leaves don't relay other nodes' frames
+//
+// Firmware: NODE_CLASS=NODE_BATTERY_LEAF
+#include "host.h"
+
+#include FIRMWARE_SOURCE
+
+#include "test.h"
+
+struct HostDone {};
+
+const uint8_t COORDINATOR = 1;
+
+bool pressed = false;
+bool won = false;
+int winnerFramesSent = 0;
+
+void hostOnSend(const uint8_t *frame, int len) {
+  DataStruct data;
+  memcpy(&data, frame, sizeof(data));
+  if (len < (int)sizeof(data) ||
+      (data.flags & (FRAME_TIMING | FRAME_FIRMWARE))) {
+    return;
+  }
+  if (isWinnerMsg(&data)) {
+    CHECK(memcmp(data.winner_mac, hostSelfMac, 6) == 0);
+    winnerFramesSent++;
+  } else {
+    pressed = true;
+  }
+}
+
+void hostOnYield() {
+  hostAdvance(100);
+  if (pressed && !won) {
+    DataStruct data = {};
+    data.counter = 1;
+    data.door_id = DOOR_ID;
+    memcpy(data.winner_mac, hostSelfMac, 6);
+    uint8_t mac[6];
+    testMac(COORDINATOR, mac);
+    uint8_t frame[MAX_FRAME_LEN];
+    int len = testFrame(COORDINATOR, &data, frame);
+    hostRecvCallback(mac, frame, len);
+    won = true;
+  }
+  if (hostNow__us > 1000000) {
+    throw HostDone();
+  }
+}
+
+int main() {
+  try {
+    setup();
+  } catch (HostDone &) {
+  }
+  CHECK(globalState == DOOR_DASH_WINNER);
+  CHECK(!isRelaying());
+  CHECK(winnerFramesSent > 10);
+  return 0;
+}
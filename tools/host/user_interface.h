@@ -0,0 +1,26 @@
+// Host stand-in, see Arduino.h
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STATION_MODE 1
+enum rst_reason {
+  REASON_DEFAULT_RST = 0,
+  REASON_SOFT_RESTART = 4,
+  REASON_DEEP_SLEEP_AWAKE = 5,
+};
+struct rst_info {
+  uint32_t reason;
+};
+typedef void (*wifi_promiscuous_cb_t)(uint8_t *buf, uint16_t len);
+bool wifi_set_opmode(uint8_t mode);
+void wifi_promiscuous_enable(uint8_t promiscuous);
+void wifi_set_promiscuous_rx_cb(wifi_promiscuous_cb_t cb);
+bool wifi_set_channel(uint8_t channel);
+
+#ifdef __cplusplus
+}
+#endif
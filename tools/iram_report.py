@@ -0,0 +1,192 @@
+#!/usr/bin/env python3
+"""Shows where the firmware's code and data ended up, symbol by symbol.
+
+    pio run -e nodemcuv2 -e nodemcuv2_iram
+    python3 tools/iram_report.py .pio/build/nodemcuv2_iram/firmware.elf \\
+        --compare .pio/build/nodemcuv2/firmware.elf
+
+Lists every function defined in src/main.cpp with its size and whether it
+runs from IRAM or from flash, then how full IRAM is and the biggest other
+users of it (the SDK and the Arduino core). With --compare, it also shows
+what moved between the two builds. Needs the toolchain's nm, which
+PlatformIO installs; pass --nm if it isn't found.
+
+Without the ESP8266 toolchain, --host builds both placements for this
+computer instead (needs g++ and nm), with IRAM_ATTR code linked at IRAM's
+address and everything else at flash's:
+
+    python3 tools/iram_report.py --host
+
+Sizes are then x86 ones, so this only shows what moves, not whether it fits.
+"""
+
+import argparse
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+
+import stress
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# ESP8266 memory map
+REGIONS = [
+    ("iram", 0x40100000, 0x40110000),
+    ("flash", 0x40200000, 0x40300000),
+    ("dram", 0x3FFE8000, 0x40000000),
+]
+NM = "xtensa-lx106-elf-nm"
+# Links the host build's .iram.text and .text where the ESP8266 maps IRAM and
+# flash, so region_of() sorts them the same way
+HOST_FLAGS = [
+    "-DHOST_IRAM_SECTION", "-no-pie",
+    "-Wl,--section-start=.iram.text=0x%x,--section-start=.text=0x%x"
+    % (REGIONS[0][1], REGIONS[1][1]),
+]
+
+
+def find_nm(requested):
+    if requested:
+        return requested
+    found = shutil.which(NM)
+    if found:
+        return found
+    packages = os.path.expanduser("~/.platformio/packages")
+    if os.path.isdir(packages):
+        for name in sorted(os.listdir(packages)):
+            path = os.path.join(packages, name, "bin", NM)
+            if name.startswith("toolchain-xtensa") and os.path.exists(path):
+                return path
+    sys.exit("Can't find %s, pass --nm" % NM)
+
+
+def region_of(address):
+    for name, start, end in REGIONS:
+        if start <= address < end:
+            return name
+    return "other"
+
+
+def read_symbols(nm, elf):
+    """Returns {name: (region, size, is_code)} for every sized symbol."""
+    output = subprocess.run(
+        [nm, "-C", "-S", "--defined-only", elf],
+        check=True, capture_output=True, text=True).stdout
+    symbols = {}
+    for line in output.splitlines():
+        match = re.match(r"([0-9a-f]+) ([0-9a-f]+) (\w) (.+)", line)
+        if not match:
+            continue  # No size
+        address, size, kind, name = match.groups()
+        symbols[name] = (region_of(int(address, 16)), int(size, 16),
+                         kind in "tTwW")
+    return symbols
+
+
+def own_functions():
+    """Names of the functions defined in src/main.cpp."""
+    with open(os.path.join(ROOT, "src", "main.cpp")) as f:
+        source = f.read()
+    definition = r"^(?:HOT_PATH )?[A-Za-z_][\w ]*[ *](\w+)\([^;]*?\{"
+    return set(re.findall(definition, source, re.M))
+
+
+def base_name(symbol):
+    return symbol.split("(")[0].split("::")[-1]
+
+
+def iram_used(symbols):
+    return sum(size for region, size, _ in symbols.values()
+               if region == "iram")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("elf", nargs="?",
+                        help="firmware.elf from .pio/build/<env>")
+    parser.add_argument("--compare", metavar="ELF",
+                        help="another build, e.g. without HOT_PATH_IN_IRAM")
+    parser.add_argument("--nm", help="path to %s" % NM)
+    parser.add_argument("--host", action="store_true",
+                        help="compare host builds with and without "
+                        "HOT_PATH_IN_IRAM instead")
+    parser.add_argument("--iram-size", type=int, default=32 << 10,
+                        help="IRAM available for code, in bytes")
+    parser.add_argument("--top", type=int, default=15,
+                        help="how many other IRAM users to list")
+    args = parser.parse_args()
+
+    if args.host:
+        with tempfile.TemporaryDirectory() as out_dir:
+            elf, compare = build_host(out_dir)
+            report(args, args.nm or "nm", elf, compare,
+                   "the host build without it")
+    elif args.elf:
+        report(args, find_nm(args.nm), args.elf, args.compare, args.compare)
+    else:
+        parser.error("pass a firmware.elf, or --host")
+
+
+def build_host(out_dir):
+    """Builds the stress harness with and without HOT_PATH_IN_IRAM, and
+    returns the two binaries."""
+    binaries = []
+    for name, flags in [("iram", ["-DHOT_PATH_IN_IRAM"]), ("flash", [])]:
+        build_dir = os.path.join(out_dir, name)
+        os.mkdir(build_dir)
+        binaries.append(stress.build(build_dir, "stress.cpp", {},
+                                     flags=HOST_FLAGS + flags))
+    return binaries
+
+
+def report(args, nm, elf, compare, compare_name):
+    symbols = read_symbols(nm, elf)
+    other = read_symbols(nm, compare) if compare else {}
+    own = own_functions()
+
+    print("Functions from src/main.cpp:")
+    header = "  %-6s %6s" % ("where", "bytes")
+    if other:
+        header += "  %-6s %6s" % ("before", "bytes")
+    print(header + "  name")
+    rows = [(region, size, name)
+            for name, (region, size, is_code) in symbols.items()
+            if is_code and base_name(name) in own]
+    rows.sort(key=lambda row: (row[0], -row[1]))
+    totals = {}
+    for region, size, name in rows:
+        totals[region] = totals.get(region, 0) + size
+        line = "  %-6s %6d" % (region, size)
+        if other:
+            before = other.get(name)
+            if before:
+                line += "  %-6s %6d" % before[:2]
+            else:
+                line += "  %-6s %6s" % ("-", "-")
+            if before and before[0] != region:
+                name += "  (moved)"
+        print(line + "  " + name)
+    print("  " + ", ".join("%d bytes in %s" % (size, region)
+                           for region, size in sorted(totals.items())))
+
+    used = iram_used(symbols)
+    print("\nIRAM: %d of %d bytes used (%.0f%%), %d free"
+          % (used, args.iram_size, 100.0 * used / args.iram_size,
+             args.iram_size - used))
+    if other:
+        print("      %+d bytes compared to %s"
+              % (used - iram_used(other), compare_name))
+    print("Biggest other IRAM users:")
+    others = sorted(((size, name)
+                     for name, (region, size, _) in symbols.items()
+                     if region == "iram" and base_name(name) not in own),
+                    reverse=True)
+    for size, name in others[:args.top]:
+        print("  %6d  %s" % (size, name))
+
+
+if __name__ == "__main__":
+    main()
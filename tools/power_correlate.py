@@ -0,0 +1,311 @@
+#!/usr/bin/env python3
+"""Splits a current capture into the firmware's power phases.
+
+    python3 tools/power_correlate.py capture.csv serial.log
+
+Build the firmware with POWER_MARKERS set and wire MARKER_PIN (D5) to a
+digital input of the current analyzer. Every power event then makes a short
+pulse on the pin and an "EV <micros> <name>" line on serial. The capture is a
+CSV with a time column, a current column and the digital input, e.g. a
+Nordic PPK2 export ("Timestamp(ms),Current(uA),D0-D7"). The log is whatever
+the serial port printed during the capture.
+
+Pulses are matched to log lines one wake at a time, by the spacing between
+them. The capture between two events is charged to the phase the first one
+starts. Sleep is split further: "settle" is how long the current takes to
+drop below --sleep-threshold after the firmware asks to sleep, and "boot" is
+the time between the current rising again and the firmware's first event.
+"""
+
+import argparse
+import bisect
+import csv
+import re
+import statistics
+import sys
+
+EVENT_LINE = re.compile(r"EV (\d+) (\w+)")
+
+# Events that start a phase. radio_on and radio_off only track the radio.
+PHASES = [
+    "wake",
+    "listen",
+    "tx",
+    "led",
+    "cooldown",
+    "firmware",
+    "shutdown",
+    "sleep",
+]
+REPORT_PHASES = PHASES[:-1] + ["settle", "sleep", "boot"]
+
+TIME_UNITS = {"s": 1.0, "ms": 1e-3, "us": 1e-6}
+CURRENT_UNITS = {"a": 1.0, "ma": 1e-3, "ua": 1e-6, "na": 1e-9}
+
+
+def read_events(path):
+    """Returns a list of wakes, each a list of (micros, name)."""
+    wakes = []
+    with open(path, errors="replace") as f:
+        for line in f:
+            match = EVENT_LINE.search(line)
+            if match is None:
+                continue
+            micros, name = int(match.group(1)), match.group(2)
+            if name == "wake" or not wakes:
+                wakes.append([])
+            wakes[-1].append((micros, name))
+    return wakes
+
+
+def find_column(header, requested, hints):
+    if requested is not None:
+        return header.index(requested)
+    for i, name in enumerate(header):
+        if any(hint in name.lower() for hint in hints):
+            return i
+    sys.exit("Can't find a column like %s in %s, pass it explicitly"
+             % (hints[0], header))
+
+
+def unit_of(name, units, requested):
+    if requested is not None:
+        return units[requested.lower()]
+    match = re.search(r"\((\w+)\)", name)
+    if match and match.group(1).lower() in units:
+        return units[match.group(1).lower()]
+    sys.exit("Can't tell the unit of column %r, pass it explicitly" % name)
+
+
+def read_capture(args):
+    """Returns sample times (s), currents (A) and marker levels."""
+    times, currents, markers = [], [], []
+    with open(args.capture, newline="") as f:
+        reader = csv.reader(f)
+        header = next(reader)
+        time_col = find_column(header, args.time_column, ["time"])
+        current_col = find_column(header, args.current_column,
+                                  ["current"])
+        marker_col = find_column(header, args.marker_column,
+                                 ["d0-d7", "marker", "digital"])
+        time_unit = unit_of(header[time_col], TIME_UNITS, args.time_unit)
+        current_unit = unit_of(header[current_col], CURRENT_UNITS,
+                               args.current_unit)
+        for row in reader:
+            if len(row) <= max(time_col, current_col, marker_col):
+                continue
+            times.append(float(row[time_col]) * time_unit)
+            currents.append(float(row[current_col]) * current_unit)
+            level = row[marker_col].strip()
+            if len(level) > 1:  # PPK2 writes all 8 channels as a bit string
+                level = level[args.marker_bit]
+            markers.append(level not in ("0", "", "0.0"))
+    return times, currents, markers
+
+
+def rising_edges(times, markers):
+    return [
+        times[i]
+        for i in range(1, len(markers))
+        if markers[i] and not markers[i - 1]
+    ]
+
+
+def intervals_match(edges, start, events, tolerance):
+    t0, us0 = edges[start], events[0][0]
+    for k in range(1, len(events)):
+        expected = (events[k][0] - us0) * 1e-6
+        actual = edges[start + k] - t0
+        if abs(actual - expected) > tolerance + expected * 0.01:
+            return False
+    return True
+
+
+def align(wakes, edges, tolerance):
+    """Returns (capture time, name, wake index) for every matched event."""
+    aligned = []
+    unmatched = 0
+    next_edge = 0
+    for index, events in enumerate(wakes):
+        for start in range(next_edge, len(edges) - len(events) + 1):
+            if intervals_match(edges, start, events, tolerance):
+                break
+        else:
+            unmatched += 1
+            continue
+        # Place events with a least squares fit, which averages out the
+        # analyzer's sampling jitter and the two clocks drifting apart
+        xs = [us * 1e-6 for us, _ in events]
+        ys = edges[start : start + len(events)]
+        if len(events) > 1 and xs[-1] != xs[0]:
+            x_mean, y_mean = statistics.fmean(xs), statistics.fmean(ys)
+            scale = sum((x - x_mean) * (y - y_mean) for x, y in zip(xs, ys))
+            scale /= sum((x - x_mean) ** 2 for x in xs)
+        else:
+            x_mean, y_mean, scale = xs[0], ys[0], 1.0
+        for x, (_, name) in zip(xs, events):
+            aligned.append((y_mean + (x - x_mean) * scale, name, index))
+        next_edge = start + len(events)
+    return aligned, unmatched
+
+
+class Integrator:
+    def __init__(self, times, currents):
+        self.times = times
+        self.currents = currents
+        # Charge in coulombs up to each sample
+        self.charge = [0.0]
+        for i in range(1, len(times)):
+            dt = times[i] - times[i - 1]
+            self.charge.append(
+                self.charge[-1] + (currents[i] + currents[i - 1]) / 2 * dt)
+
+    def index(self, t):
+        return min(bisect.bisect_left(self.times, t), len(self.times) - 1)
+
+    def between(self, start, end):
+        """Returns (charge in C, peak current in A)."""
+        i, j = self.index(start), self.index(end)
+        peak = max(self.currents[i : j + 1]) if j >= i else 0.0
+        return self.charge[j] - self.charge[i], peak
+
+    def first_below(self, start, end, threshold):
+        for i in range(self.index(start), self.index(end) + 1):
+            if self.currents[i] < threshold:
+                return self.times[i]
+        return end
+
+    def last_below(self, start, end, threshold):
+        for i in range(self.index(end), self.index(start) - 1, -1):
+            if self.currents[i] < threshold:
+                return self.times[i]
+        return start
+
+
+def segments(aligned, integrator, threshold):
+    """Yields (wake, phase, start, end, radio_on) for each stretch."""
+    phase = None
+    radio = False
+    for k in range(len(aligned) - 1):
+        t, name, wake = aligned[k]
+        next_t, next_name, next_wake = aligned[k + 1]
+        if name == "radio_on":
+            radio = True
+        elif name == "radio_off":
+            radio = False
+        elif name in PHASES:
+            phase = name
+        if phase is None:
+            continue
+        if next_wake != wake and phase != "sleep":
+            phase = None  # A wake we couldn't match, don't guess
+            continue
+        if phase != "sleep":
+            yield wake, phase, t, next_t, radio
+            continue
+        if next_name != "wake" or next_wake != wake + 1:
+            phase = None
+            continue
+        # The chip boots (and for deep sleep, restarts from scratch) before
+        # the firmware can mark anything
+        settled = integrator.first_below(t, next_t, threshold)
+        booting = integrator.last_below(settled, next_t, threshold)
+        yield wake, "settle", t, settled, radio
+        yield wake, "sleep", settled, booting, False
+        yield wake, "boot", booting, next_t, False
+        phase = None
+        radio = False
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("capture", help="current capture CSV")
+    parser.add_argument("log", help="serial output with EV lines")
+    parser.add_argument("--time-column")
+    parser.add_argument("--current-column")
+    parser.add_argument("--marker-column")
+    parser.add_argument("--marker-bit", type=int, default=0,
+                        help="channel within a D0-D7 style bit string")
+    parser.add_argument("--time-unit", choices=TIME_UNITS)
+    parser.add_argument("--current-unit", choices=CURRENT_UNITS)
+    parser.add_argument("--voltage", type=float, default=3.7,
+                        help="supply voltage, for energy")
+    parser.add_argument("--sleep-threshold", type=float, default=1.0,
+                        metavar="MA", help="current counted as asleep")
+    parser.add_argument("--tolerance", type=float, default=0.5, metavar="MS",
+                        help="allowed pulse timing error")
+    parser.add_argument("--segments", metavar="CSV",
+                        help="write every phase of every wake to this file")
+    args = parser.parse_args()
+
+    wakes = read_events(args.log)
+    times, currents, markers = read_capture(args)
+    edges = rising_edges(times, markers)
+    aligned, unmatched = align(wakes, edges, args.tolerance * 1e-3)
+    print("%d marker pulses, %d wakes logged, %d matched"
+          % (len(edges), len(wakes), len(wakes) - unmatched))
+    if not aligned:
+        sys.exit("Nothing lined up. Check the marker column and bit.")
+
+    integrator = Integrator(times, currents)
+    rows = []
+    for wake, phase, start, end, radio in segments(
+            aligned, integrator, args.sleep_threshold * 1e-3):
+        charge, peak = integrator.between(start, end)
+        duration_ms = (end - start) * 1e3
+        if rows and rows[-1]["wake"] == wake and rows[-1]["phase"] == phase:
+            row = rows[-1]  # Only the radio changed, same phase
+        else:
+            row = {"wake": wake, "phase": phase, "start_s": start,
+                   "duration_ms": 0.0, "mean_ma": 0.0, "peak_ma": 0.0,
+                   "charge_uah": 0.0, "energy_mj": 0.0, "radio_on_ms": 0.0}
+            rows.append(row)
+        row["duration_ms"] += duration_ms
+        row["peak_ma"] = max(row["peak_ma"], peak * 1e3)
+        row["charge_uah"] += charge / 3.6e-3
+        row["energy_mj"] += charge * args.voltage * 1e3
+        row["radio_on_ms"] += duration_ms if radio else 0.0
+        if row["duration_ms"] > 0:
+            row["mean_ma"] = row["charge_uah"] * 3600 / row["duration_ms"]
+
+    total = sum(row["charge_uah"] for row in rows) or 1.0
+    print("%-9s %5s %11s %9s %9s %11s %10s %6s"
+          % ("phase", "count", "time ms", "mean mA", "peak mA", "charge uAh",
+             "energy mJ", "share"))
+    for phase in REPORT_PHASES:
+        selected = [row for row in rows if row["phase"] == phase]
+        if not selected:
+            continue
+        duration = sum(row["duration_ms"] for row in selected)
+        charge = sum(row["charge_uah"] for row in selected)
+        print("%-9s %5d %11.1f %9.2f %9.1f %11.3f %10.3f %5.1f%%"
+              % (phase, len(selected), duration,
+                 charge * 3600 / duration if duration else 0.0,
+                 max(row["peak_ma"] for row in selected), charge,
+                 sum(row["energy_mj"] for row in selected),
+                 100 * charge / total))
+    radio_ms = sum(row["radio_on_ms"] for row in rows)
+    print("Radio on for %.1f ms in total" % radio_ms)
+
+    # Flag any instance of a phase that costs far more than usual
+    for phase in REPORT_PHASES:
+        selected = [row for row in rows if row["phase"] == phase]
+        if len(selected) < 3:
+            continue
+        typical = statistics.median(row["charge_uah"] for row in selected)
+        for row in selected:
+            if row["charge_uah"] > 3 * typical and row["charge_uah"] > 0.01:
+                print("Unusual %s in wake %d at %.3f s: %.1f ms, %.3f uAh "
+                      "(typically %.3f)" % (phase, row["wake"], row["start_s"],
+                                            row["duration_ms"],
+                                            row["charge_uah"], typical))
+
+    if args.segments:
+        with open(args.segments, "w", newline="") as f:
+            writer = csv.DictWriter(f, fieldnames=list(rows[0]))
+            writer.writeheader()
+            writer.writerows(rows)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,102 @@
+"""Framing for the binary records the firmware writes to its serial port.
+
+Records share the port with the normal text logs. The host sends records the
+same way. Each one is:
+
+    D0 DA | type (1) | length (1) | payload (length) | CRC-16 (2, little endian)
+
+The CRC is CRC-16/CCITT-FALSE over type, length and payload. This mirrors
+writeSerialRecord() in src/main.cpp.
+"""
+
+import struct
+import sys
+
+SYNC = b"\xd0\xda"
+
+RECORD_TELEMETRY = 1
+RECORD_FIRMWARE_OFFER = 2  # Host to coordinator, see tools/fwpush.py
+RECORD_FIRMWARE_CHUNK = 3  # Host to coordinator
+RECORD_FIRMWARE_ACK = 4
+RECORD_TIMING = 5  # Host to coordinator, see tools/timing.py
+RECORD_TIMING_ACK = 6
+RECORD_SNIFFED = 7  # From a sniffer node, see tools/sniff.py
+
+
+def crc16(data, crc=0xFFFF):
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def encode(record_type, payload):
+    header = bytes([record_type, len(payload)])
+    crc = crc16(header + payload)
+    return SYNC + header + payload + struct.pack("<H", crc)
+
+
+class Parser:
+    """Splits a byte stream into records and the text in between.
+
+    Feed it whatever the port returns. Anything that isn't a valid record
+    (including records with a bad CRC) is passed through as text.
+    """
+
+    def __init__(self):
+        self.buffer = b""
+
+    def feed(self, data):
+        """Returns a list of ("record", type, payload) and ("text", bytes)."""
+        self.buffer += data
+        out = []
+        while True:
+            start = self.buffer.find(SYNC)
+            if start < 0:
+                # Keep a trailing 0xD0 in case the sync is split across reads
+                keep = 1 if self.buffer.endswith(SYNC[:1]) else 0
+                text = self.buffer[: len(self.buffer) - keep]
+                if text:
+                    out.append(("text", text))
+                self.buffer = self.buffer[len(self.buffer) - keep :]
+                return out
+            if start > 0:
+                out.append(("text", self.buffer[:start]))
+                self.buffer = self.buffer[start:]
+            if len(self.buffer) < 4:
+                return out
+            length = self.buffer[3]
+            total = 4 + length + 2
+            if len(self.buffer) < total:
+                return out
+            body = self.buffer[2 : 4 + length]
+            (crc,) = struct.unpack_from("<H", self.buffer, 4 + length)
+            if crc16(body) == crc:
+                out.append(("record", body[0], body[2:]))
+                self.buffer = self.buffer[total:]
+            else:
+                out.append(("text", self.buffer[:2]))
+                self.buffer = self.buffer[2:]
+
+
+def open_source(path, baud=115200):
+    """Opens a serial port, or a capture file, or stdin for "-"."""
+    if path == "-":
+        return sys.stdin.buffer
+    if path.startswith("/dev/") or path.upper().startswith("COM"):
+        import serial  # pip install pyserial
+
+        return serial.Serial(path, baud, timeout=0.1)
+    return open(path, "rb")
+
+
+def read_chunks(source):
+    while True:
+        data = source.read(256)
+        if not data:
+            if hasattr(source, "in_waiting"):  # Serial port, keep waiting
+                continue
+            return
+        yield data
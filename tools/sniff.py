@@ -0,0 +1,349 @@
+#!/usr/bin/env python3
+"""Records a sniffer node's ESP-NOW frames and measures their airtime.
+
+    python3 tools/sniff.py /dev/cu.usbserial-21210 --pcap dash.pcap
+
+The source is a node built with IS_SNIFFER set, or a file captured from its
+port, or "-" for stdin. Every frame is written to the pcap file (802.11 with
+a radiotap header, so Wireshark shows RSSI, rate and channel). The 802.11
+headers are rebuilt from what the node sends: the 4 random bytes of the
+ESP-NOW header are zeroed, and bodies longer than the sniffer captures
+(firmware chunks) are cut short.
+
+Frames from our groups are grouped into dashes per door. A dash ends when its
+door has been quiet for --dash-gap seconds, and a summary line is printed:
+the frames each kind, how much airtime they took, and how busy the channel
+was overall during the dash (all ESP-NOW frames, from any group), on average
+and over the busiest --window. --dashes and --utilization write the same
+numbers as CSV.
+"""
+
+import argparse
+import collections
+import csv
+import math
+import struct
+import sys
+import time
+
+import serial_records
+
+# SniffedFrame from src/main.cpp, before the body
+SNIFFED_FORMAT = "<IbBBH6sHB"
+SNIFFED_SIZE = struct.calcsize(SNIFFED_FORMAT)
+# DataStruct from src/main.cpp
+DATA_FORMAT = "<HBIBB6s6s"
+DATA_SIZE = struct.calcsize(DATA_FORMAT)
+
+FRAME_FIRMWARE = 1 << 1
+FRAME_TIMING = 1 << 4
+
+# The SDK's rate codes, in Mbit/s
+DSSS_RATES = {0x0: 1, 0x1: 2, 0x2: 5.5, 0x3: 11}
+OFDM_RATES = {0xB: 6, 0xF: 9, 0xA: 12, 0xE: 18, 0x9: 24, 0xD: 36, 0x8: 48,
+              0xC: 54}
+HT_RATES = [6.5, 13, 19.5, 26, 39, 52, 58.5, 65]  # 20 MHz, long guard
+
+PCAP_LINKTYPE_RADIOTAP = 127
+
+
+def airtime_us(rate, length):
+    """Time on air for a frame of length bytes, preamble included."""
+    if rate & 0x80:
+        mbps = HT_RATES[(rate & 0x7F) % len(HT_RATES)]
+        symbols = math.ceil((22 + 8 * length) / (mbps * 4))
+        return 36 + 4 * symbols
+    if rate in OFDM_RATES:
+        symbols = math.ceil((22 + 8 * length) / (OFDM_RATES[rate] * 4))
+        return 20 + 4 * symbols
+    # Long preamble, which is what ESP-NOW's default 1 Mbit/s uses
+    return 192 + 8 * length / DSSS_RATES.get(rate, 1)
+
+
+class Frame:
+    def __init__(self, payload, base_us):
+        (at_us, self.rssi, self.rate, self.channel, self.length, sender,
+         self.sequence, self.body_len) = struct.unpack_from(SNIFFED_FORMAT,
+                                                            payload)
+        self.t = (base_us + at_us) * 1e-6
+        self.sender = sender.hex(":")
+        self.sender_bytes = sender
+        self.body = payload[SNIFFED_SIZE:]
+        self.airtime = airtime_us(self.rate, self.length) * 1e-6
+        self.data = None
+        if len(self.body) >= DATA_SIZE:
+            self.data = struct.unpack_from(DATA_FORMAT, self.body)
+
+    def kind(self):
+        if self.data is None:
+            return "other"
+        flags, winner = self.data[4], self.data[6]
+        if flags & FRAME_FIRMWARE:
+            return "firmware"
+        if flags & FRAME_TIMING:
+            return "timing"
+        return "winner" if any(winner) else "pressed"
+
+
+class PcapWriter:
+    def __init__(self, path):
+        self.file = open(path, "wb")
+        self.file.write(struct.pack("<IHHiIII", 0xA1B2C3D4, 2, 4, 0, 0,
+                                    65535, PCAP_LINKTYPE_RADIOTAP))
+
+    def write(self, frame, host_time):
+        # Radiotap with flags, rate, channel and antenna signal
+        if frame.rate & 0x80:
+            rate, channel_flags = 0, 0x0080  # Radiotap rate can't say MCS
+        elif frame.rate in OFDM_RATES:
+            rate, channel_flags = int(OFDM_RATES[frame.rate] * 2), 0x00C0
+        else:
+            rate = int(DSSS_RATES.get(frame.rate, 1) * 2)
+            channel_flags = 0x00A0
+        radiotap = struct.pack("<BBHIBBHHb", 0, 0, 15, 0x2E, 0, rate,
+                               2407 + 5 * frame.channel, channel_flags,
+                               frame.rssi)
+        # Vendor specific action frame to the broadcast address
+        header = (b"\xd0\x00\x00\x00" + b"\xff" * 6 + frame.sender_bytes
+                  + b"\xff" * 6 + struct.pack("<H", frame.sequence))
+        action = (b"\x7f\x18\xfe\x34" + bytes(4) + b"\xdd"
+                  + bytes([frame.body_len + 5]) + b"\x18\xfe\x34\x04\x01")
+        packet = radiotap + header + action + frame.body
+        original = len(packet) + frame.body_len - len(frame.body)
+        seconds = int(host_time)
+        self.file.write(struct.pack("<IIII", seconds,
+                                    int((host_time - seconds) * 1e6),
+                                    len(packet), original))
+        self.file.write(packet)
+
+    def close(self):
+        self.file.close()
+
+
+class Channel:
+    """Airtime of recent frames, to measure how busy the channel was."""
+
+    def __init__(self):
+        self.frames = collections.deque()
+
+    def add(self, frame):
+        self.frames.append((frame.t, frame.airtime))
+
+    def trim(self, before):
+        while self.frames and self.frames[0][0] < before:
+            self.frames.popleft()
+
+    def busy(self, start, end):
+        return sum(a for t, a in self.frames if start <= t <= end)
+
+    def peak(self, start, end, window):
+        """Busiest window within [start, end], as a fraction."""
+        times = [(t, a) for t, a in self.frames if start <= t <= end]
+        best, total, first = 0.0, 0.0, 0
+        for t, a in times:
+            total += a
+            while times[first][0] < t - window:
+                total -= times[first][1]
+                first += 1
+            best = max(best, total)
+        return min(best / window, 1.0)
+
+
+class Dash:
+    def __init__(self, group, door, frame):
+        self.group, self.door = group, door
+        self.start = self.last = frame.t
+        self.last_airtime = 0.0
+        self.kinds = collections.Counter()
+        self.senders = collections.Counter()
+        self.airtime = 0.0
+        self.rssi = []
+        self.first_winner = None
+
+    def add(self, frame):
+        kind = frame.kind()
+        self.kinds[kind] += 1
+        self.senders[frame.sender] += 1
+        self.airtime += frame.airtime
+        self.rssi.append(frame.rssi)
+        self.last, self.last_airtime = frame.t, frame.airtime
+        if kind == "winner" and self.first_winner is None:
+            self.first_winner = frame.t
+
+    def summary(self, channel, window):
+        duration = self.last + self.last_airtime - self.start
+        busy = channel.busy(self.start, self.last)
+        frames = sum(self.kinds.values())
+        top, top_frames = self.senders.most_common(1)[0]
+        return {
+            "group": "%04x" % self.group,
+            "door": self.door,
+            "start_s": "%.3f" % self.start,
+            "duration_s": "%.3f" % duration,
+            "frames": frames,
+            "pressed": self.kinds["pressed"],
+            "winner": self.kinds["winner"],
+            "senders": len(self.senders),
+            "busiest_sender": top,
+            "busiest_sender_frames": top_frames,
+            "airtime_ms": "%.1f" % (self.airtime * 1e3),
+            "channel_busy_ms": "%.1f" % (busy * 1e3),
+            "utilization": "%.3f" % (busy / duration if duration else 0),
+            "peak_utilization": "%.3f" % channel.peak(self.start, self.last,
+                                                      window),
+            "winner_after_ms": ("%.0f" % ((self.first_winner - self.start)
+                                          * 1e3)
+                                if self.first_winner else ""),
+            "mean_rssi": "%.1f" % (sum(self.rssi) / len(self.rssi)),
+        }
+
+
+def print_dash(row):
+    print("Group %s door %d: %s s, %d frames (%d pressed, %d winner) from %d "
+          "senders, %s ms on air, channel %.1f%% busy (%.1f%% at peak)%s"
+          % (row["group"], row["door"], row["duration_s"], row["frames"],
+             row["pressed"], row["winner"], row["senders"], row["airtime_ms"],
+             float(row["utilization"]) * 100,
+             float(row["peak_utilization"]) * 100,
+             ", winner after %s ms" % row["winner_after_ms"]
+             if row["winner_after_ms"] else ""))
+
+
+class Utilization:
+    """Per second totals for every ESP-NOW frame heard."""
+
+    def __init__(self, path):
+        self.file = open(path, "w", newline="")
+        self.writer = csv.writer(self.file)
+        self.writer.writerow(["second", "frames", "airtime_ms",
+                              "utilization"])
+        self.second = None
+        self.frames = 0
+        self.airtime = 0.0
+
+    def add(self, frame):
+        second = int(frame.t)
+        if self.second is not None and second != self.second:
+            self.flush()
+        self.second = second
+        self.frames += 1
+        self.airtime += frame.airtime
+
+    def flush(self):
+        if self.second is not None:
+            self.writer.writerow([self.second, self.frames,
+                                  "%.2f" % (self.airtime * 1e3),
+                                  "%.4f" % self.airtime])
+        self.frames, self.airtime = 0, 0.0
+
+    def close(self):
+        self.flush()
+        self.file.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="serial port, capture file, or -")
+    parser.add_argument("--baud", type=int, default=921600)
+    parser.add_argument("--pcap", help="write every frame to this file")
+    parser.add_argument("--groups", type=lambda v: int(v, 16), nargs="*",
+                        metavar="HEX", help="group ids to track dashes for, "
+                        "every group by default")
+    parser.add_argument("--dash-gap", type=float, default=3.0, metavar="S")
+    parser.add_argument("--window", type=float, default=0.1, metavar="S",
+                        help="window for peak channel utilization")
+    parser.add_argument("--dashes", metavar="CSV",
+                        help="write each dash's summary to this file")
+    parser.add_argument("--utilization", metavar="CSV",
+                        help="write the channel's load every second")
+    args = parser.parse_args()
+
+    records = serial_records.Parser()
+    source = serial_records.open_source(args.source, args.baud)
+    pcap = PcapWriter(args.pcap) if args.pcap else None
+    utilization = Utilization(args.utilization) if args.utilization else None
+    dash_file = open(args.dashes, "w", newline="") if args.dashes else None
+    dash_writer = None
+    channel = Channel()
+    dashes = {}
+    host_start = None
+    base_us, last_us = 0, None
+    totals = collections.Counter()
+    total_airtime = 0.0
+    first_t = last_t = None
+
+    def finish(dash):
+        nonlocal dash_writer
+        row = dash.summary(channel, args.window)
+        print_dash(row)
+        if dash_file:
+            if dash_writer is None:
+                dash_writer = csv.DictWriter(dash_file, fieldnames=list(row))
+                dash_writer.writeheader()
+            dash_writer.writerow(row)
+
+    try:
+        for chunk in serial_records.read_chunks(source):
+            for item in records.feed(chunk):
+                if item[0] == "text":
+                    sys.stderr.write(item[1].decode("utf-8", "replace"))
+                    continue
+                _, record_type, payload = item
+                if (record_type != serial_records.RECORD_SNIFFED
+                        or len(payload) < SNIFFED_SIZE):
+                    continue
+                (at_us,) = struct.unpack_from("<I", payload)
+                if last_us is not None and at_us < last_us:
+                    base_us += 1 << 32  # micros() wrapped
+                last_us = at_us
+                frame = Frame(payload, base_us)
+                if host_start is None:
+                    host_start = time.time() - frame.t
+                if first_t is None:
+                    first_t = frame.t
+                last_t = frame.t
+                totals[frame.kind()] += 1
+                total_airtime += frame.airtime
+                channel.add(frame)
+                if pcap:
+                    pcap.write(frame, host_start + frame.t)
+                if utilization:
+                    utilization.add(frame)
+
+                for key, dash in list(dashes.items()):
+                    if frame.t - dash.last > args.dash_gap:
+                        finish(dash)
+                        del dashes[key]
+                kind = frame.kind()
+                if kind in ("pressed", "winner") and (
+                        not args.groups or frame.data[0] in args.groups):
+                    key = (frame.data[0], frame.data[1])
+                    if key not in dashes:
+                        dashes[key] = Dash(key[0], key[1], frame)
+                    dashes[key].add(frame)
+                oldest = min((d.start for d in dashes.values()),
+                             default=frame.t - args.window)
+                channel.trim(min(oldest, frame.t - args.window))
+    except KeyboardInterrupt:
+        pass
+
+    for dash in dashes.values():
+        finish(dash)
+    if pcap:
+        pcap.close()
+    if utilization:
+        utilization.close()
+    if dash_file:
+        dash_file.close()
+    if first_t is None:
+        sys.exit("No frames")
+    duration = last_t - first_t
+    print("%d frames over %.1f s (%s), %.1f ms on air, channel %.2f%% busy"
+          % (sum(totals.values()), duration,
+             ", ".join("%d %s" % (n, kind) for kind, n in totals.items()),
+             total_airtime * 1e3,
+             100 * total_airtime / duration if duration else 0))
+
+
+if __name__ == "__main__":
+    main()
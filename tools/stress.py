@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+"""Finds how many pressed frames a second the coordinator keeps up with.
+
+    python3 tools/stress.py --rates 100 200 400 800
+
+Builds src/main.cpp as a coordinator for this computer (needs g++), against
+the fake ESP8266 and radio in tools/host, and floods it with pressed frames
+from --senders buttons at each offered rate. For each rate it prints how many
+frames a second the coordinator handled, how many were dropped because its
+RX queue was full, and how long senders waited for the winner reply (from
+wanting to send a pressed frame to the reply being on air). Time is
+simulated, so results don't depend on this computer's speed, but the CPU
+cost of a callback is a guess: set --callback-us from the cycle counts a
+real coordinator prints ("callbacks, mean ... us"). Serial output is
+charged at --baud.
+
+A traffic generator node (IS_TRAFFIC_GENERATOR in src/main.cpp) puts the same
+load on a real coordinator.
+"""
+
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+HOST = os.path.join(ROOT, "tools", "host")
+
+COLUMNS = [
+    ("offered_fps", "offered/s", "%9.0f"),
+    ("processed_fps", "handled/s", "%9.0f"),
+    ("dropped", "dropped", "%7d"),
+    ("latency_p50_ms", "p50 ms", "%8.1f"),
+    ("latency_p99_ms", "p99 ms", "%8.1f"),
+    ("latency_max_ms", "max ms", "%8.1f"),
+    ("max_rx_queue", "queue", "%5d"),
+    ("channel_utilization", "channel", "%7.0f%%"),
+    ("serial_blocked_ms", "serial ms", "%9.0f"),
+]
+
+
+def set_constant(source, name, value):
+    pattern = r"(const \w+ %s =\s*)[^;]+;" % name
+    if not re.search(pattern, source):
+        sys.exit("Can't find %s in src/main.cpp" % name)
+    return re.sub(pattern, r"\g<1>%s;" % value, source, count=1)
+
+
+def build(out_dir, harness, constants, baud=115200, flags=()):
+    """Builds tools/host/<harness> around src/main.cpp with some constants
+    changed, and returns the binary's path. flags go to g++ as they are."""
+    with open(os.path.join(ROOT, "src", "main.cpp")) as f:
+        source = f.read()
+    for name, value in constants.items():
+        source = set_constant(source, name, value)
+    source = source.replace("Serial.begin(115200)", "Serial.begin(%d)" % baud)
+    firmware = os.path.join(out_dir, "firmware.cpp")
+    with open(firmware, "w") as f:
+        f.write(source)
+    binary = os.path.join(out_dir, os.path.splitext(harness)[0])
+    subprocess.run(
+        ["g++", "-O2", "-std=gnu++17", "-Wall", "-Wextra", "-Werror",
+         "-I" + HOST,
+         '-DFIRMWARE_SOURCE="%s"' % firmware,
+         os.path.join(HOST, harness), os.path.join(HOST, "platform.cpp"),
+         "-o", binary] + list(flags),
+        check=True)
+    return binary
+
+
+def run(binary, settings):
+    output = subprocess.run(
+        [binary] + ["%s=%s" % item for item in settings.items()],
+        check=True, capture_output=True, text=True).stdout
+    return {key: float(value) for key, value in
+            (line.split("=") for line in output.split())}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--rates", type=float, nargs="+",
+                        default=[50, 100, 200, 400, 600, 800, 1200])
+    parser.add_argument("--duration", type=float, default=5, metavar="S")
+    parser.add_argument("--senders", type=int, default=20)
+    parser.add_argument("--doors", type=int, default=1)
+    parser.add_argument("--telemetry-every", type=int, default=10,
+                        metavar="N", help="frames per telemetry frame")
+    parser.add_argument("--rx-queue", type=int, default=8,
+                        help="frames the radio buffers for the callback")
+    parser.add_argument("--callback-us", type=int, default=100)
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--latency-budget", type=float, default=50,
+                        metavar="MS", help="p99 reply latency to call it "
+                        "keeping up")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--echo", action="store_true",
+                        help="show the coordinator's serial output")
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory() as out_dir:
+        binary = build(out_dir, "stress.cpp", {
+            "IS_COORDINATOR": "true",
+            "NUM_DOORS": str(args.doors),
+        }, args.baud)
+        print(" ".join(label.rjust(len(fmt % 0)) for _, label, fmt in COLUMNS))
+        sustained = None
+        for rate in args.rates:
+            result = run(binary, {
+                "rate": rate,
+                "duration": args.duration,
+                "senders": args.senders,
+                "doors": args.doors,
+                "telemetry_every": args.telemetry_every,
+                "rx_queue": args.rx_queue,
+                "callback_us": args.callback_us,
+                "seed": args.seed,
+                "echo": int(args.echo),
+            })
+            result["channel_utilization"] *= 100
+            print(" ".join(fmt % result[key] for key, _, fmt in COLUMNS))
+            if (result["dropped"] == 0
+                    and result["latency_p99_ms"] <= args.latency_budget):
+                sustained = result["processed_fps"]
+    if sustained is None:
+        print("Didn't keep up at any rate")
+    else:
+        print("Keeps up with %.0f frames/s (no drops, p99 under %g ms)"
+              % (sustained, args.latency_budget))
+
+
+if __name__ == "__main__":
+    main()
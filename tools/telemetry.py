@@ -0,0 +1,122 @@
+#!/usr/bin/env python3
+"""Decodes the coordinator's telemetry stream into per-node time series.
+
+    python3 tools/telemetry.py /dev/cu.usbserial-21210 --out telemetry/
+
+Writes one CSV per node (named after its MAC) to the output directory,
+appending to any existing files. The coordinator's text logs are passed
+through to stderr. The source can also be a file captured from the port, or
+"-" for stdin.
+"""
+
+import argparse
+import csv
+import os
+import struct
+import sys
+import time
+
+import serial_records
+
+# uint32 coordinator millis, then TelemetryStruct from src/main.cpp
+TELEMETRY_FORMAT = "<I6sHHHHBHBH"
+
+FIELDS = [
+    "host_time",
+    "coordinator_ms",
+    "wakes",
+    "dashes",
+    "tx_frames",
+    "rx_frames",
+    "missed_winners",
+    "last_latency_ms",
+    "battery_mv",
+    "timing_version",
+]
+
+
+def decode_battery(battery):
+    return 0 if battery == 0 else 2000 + battery * 10
+
+
+def decode_telemetry(payload):
+    if len(payload) != struct.calcsize(TELEMETRY_FORMAT):
+        return None
+    (
+        coordinator_ms,
+        mac,
+        wakes,
+        dashes,
+        tx_frames,
+        rx_frames,
+        missed_winners,
+        last_latency_ms,
+        battery,
+        timing_version,
+    ) = struct.unpack(TELEMETRY_FORMAT, payload)
+    return mac.hex(":"), {
+        "host_time": "%.3f" % time.time(),
+        "coordinator_ms": coordinator_ms,
+        "wakes": wakes,
+        "dashes": dashes,
+        "tx_frames": tx_frames,
+        "rx_frames": rx_frames,
+        "missed_winners": missed_winners,
+        "last_latency_ms": last_latency_ms,
+        "battery_mv": decode_battery(battery),
+        "timing_version": timing_version,
+    }
+
+
+def append_row(out_dir, mac, row):
+    path = os.path.join(out_dir, mac.replace(":", "") + ".csv")
+    is_new = not os.path.exists(path)
+    with open(path, "a", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=FIELDS)
+        if is_new:
+            writer.writeheader()
+        writer.writerow(row)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", help="serial port, capture file, or -")
+    parser.add_argument("--out", default="telemetry", help="output directory")
+    parser.add_argument("--baud", type=int, default=115200)
+    args = parser.parse_args()
+
+    os.makedirs(args.out, exist_ok=True)
+    records = serial_records.Parser()
+    source = serial_records.open_source(args.source, args.baud)
+    for chunk in serial_records.read_chunks(source):
+        for item in records.feed(chunk):
+            if item[0] == "text":
+                sys.stderr.write(item[1].decode("utf-8", "replace"))
+                continue
+            _, record_type, payload = item
+            if record_type != serial_records.RECORD_TELEMETRY:
+                continue
+            decoded = decode_telemetry(payload)
+            if decoded is None:
+                continue
+            mac, row = decoded
+            append_row(args.out, mac, row)
+            print(
+                "%s wakes=%d dashes=%d tx=%d rx=%d missed=%d latency=%dms "
+                "battery=%dmV timing=%d"
+                % (
+                    mac,
+                    row["wakes"],
+                    row["dashes"],
+                    row["tx_frames"],
+                    row["rx_frames"],
+                    row["missed_winners"],
+                    row["last_latency_ms"],
+                    row["battery_mv"],
+                    row["timing_version"],
+                )
+            )
+
+
+if __name__ == "__main__":
+    main()
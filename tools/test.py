@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+"""Runs the host tests, tools/host/test_*.cpp.
+
+    python3 tools/test.py
+    python3 tools/test.py replay
+
+Each test is built like tools/stress.py builds the coordinator: a copy of
+src/main.cpp, with the constants on the test's "// Firmware:" line changed,
+against the fake ESP8266 and radio in tools/host. A test passes if it exits
+with 0, and prints what went wrong otherwise.
+"""
+
+import argparse
+import glob
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+import stress
+
+
+def constants(test):
+    with open(test) as f:
+        match = re.search(r"^// Firmware:(.*)$", f.read(), re.M)
+    if not match:
+        return {}
+    return dict(item.split("=") for item in match.group(1).split())
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("names", nargs="*",
+                        help="tests to run, e.g. replay for test_replay.cpp")
+    args = parser.parse_args()
+
+    tests = sorted(glob.glob(os.path.join(stress.HOST, "test_*.cpp")))
+    if args.names:
+        tests = [test for test in tests
+                 if os.path.basename(test)[5:-4] in args.names]
+    failed = []
+    for test in tests:
+        name = os.path.basename(test)[5:-4]
+        with tempfile.TemporaryDirectory() as out_dir:
+            binary = stress.build(out_dir, os.path.basename(test),
+                                  constants(test))
+            result = subprocess.run([binary])
+        print("%-12s %s" % (name, "ok" if result.returncode == 0
+                            else "FAILED"))
+        if result.returncode != 0:
+            failed.append(name)
+    if failed:
+        sys.exit("%d of %d tests failed" % (len(failed), len(tests)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""Pushes a timing profile to every button through the coordinator.
+
+    python3 tools/timing.py /dev/cu.usbserial-21210 --profile max-battery
+    python3 tools/timing.py /dev/cu.usbserial-21210 --sleep-ms 3000
+
+The coordinator checks the config, saves it and repeats it over ESP-NOW for
+two minutes. Buttons pick it up in a listen window and switch to it on their
+next wake, so a button asleep for the whole announcement catches up the next
+time the coordinator hears its telemetry. Overriding any value sends a custom
+profile based on --profile. Each push gets the next version number unless
+--version is given.
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+import serial_records
+
+# TimingConfig from src/main.cpp
+TIMING_FORMAT = "<HBIHHHHHHH"
+
+PROFILES = ["balanced", "low-latency", "max-battery", "custom"]
+PROFILE_CUSTOM = 3
+
+# TIMING_PROFILES from src/main.cpp with sleep in ms, the base for custom
+# configs
+DEFAULTS = {
+    "balanced": (2000, 50, 20, 500, 120, 17000, 5000, 15000),
+    "low-latency": (1000, 50, 10, 500, 120, 17000, 5000, 15000),
+    "max-battery": (4000, 40, 15, 500, 120, 12000, 6000, 5000),
+}
+
+OVERRIDES = [
+    ("sleep_ms", "time between wakes"),
+    ("listen_ms", "how long a wake listens for a dash"),
+    ("rebroadcast_ms", "interval between repeated frames"),
+    ("waiting_flash_ms", "LED blink period while coordinating"),
+    ("winner_flash_ms", "LED blink period on the winning door"),
+    ("coordination_ms", "how long a dash runs"),
+    ("flash_ms", "how long the LED shows the result"),
+    ("cool_down_ms", "how long the LED stays on after a dash"),
+]
+
+
+def pack(version, profile, values):
+    sleep_ms = values[0]
+    return struct.pack(TIMING_FORMAT, version, profile, sleep_ms * 1000,
+                       *values[1:])
+
+
+def describe(payload):
+    fields = struct.unpack(TIMING_FORMAT, payload)
+    version, profile, sleep_us = fields[:3]
+    values = [sleep_us // 1000] + list(fields[3:])
+    name = PROFILES[profile] if profile < len(PROFILES) else str(profile)
+    return "version %d (%s): %s" % (version, name, ", ".join(
+        "%s=%d" % (key, value)
+        for (key, _), value in zip(OVERRIDES, values)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("port", help="coordinator serial port")
+    parser.add_argument("--profile", choices=PROFILES[:-1],
+                        default="balanced")
+    parser.add_argument("--version", type=int, default=0,
+                        help="0 for one more than the current version")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--timeout", type=float, default=5.0)
+    for name, help_text in OVERRIDES:
+        parser.add_argument("--" + name.replace("_", "-"), type=int,
+                            help=help_text)
+    args = parser.parse_args()
+
+    values = list(DEFAULTS[args.profile])
+    profile = PROFILES.index(args.profile)
+    for i, (name, _) in enumerate(OVERRIDES):
+        if getattr(args, name) is not None:
+            values[i] = getattr(args, name)
+            profile = PROFILE_CUSTOM
+    payload = pack(args.version, profile, values)
+
+    port = serial_records.open_source(args.port, args.baud)
+    records = serial_records.Parser()
+    port.write(serial_records.encode(serial_records.RECORD_TIMING, payload))
+    deadline = time.time() + args.timeout
+    while time.time() < deadline:
+        for item in records.feed(port.read(256)):
+            if item[0] == "text":
+                sys.stderr.write(item[1].decode("utf-8", "replace"))
+                continue
+            _, record_type, reply = item
+            if record_type != serial_records.RECORD_TIMING_ACK:
+                continue
+            if len(reply) != struct.calcsize(TIMING_FORMAT):
+                continue
+            print("Coordinator is using " + describe(reply))
+            (version,) = struct.unpack_from("<H", reply)
+            if reply[2:] != payload[2:] or version < args.version:
+                sys.exit("The config was rejected, check the values")
+            return
+    sys.exit("No reply from the coordinator")
+
+
+if __name__ == "__main__":
+    main()